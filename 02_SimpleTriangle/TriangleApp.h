@@ -1,4 +1,4 @@
-#pragma once
+﻿#pragma once
 
 #include "../common/vkappbase.h"
 #include "glm/glm.hpp"
@@ -6,7 +6,8 @@
 class TriangleApp : public VulkanAppBase
 {
 public:
-  TriangleApp() : VulkanAppBase() { }
+  // 毎フレーム同じコマンドなので、静的コマンドモードで記録を 1 度だけにする.
+  TriangleApp() : VulkanAppBase() { setStaticCommandMode(true); }
 
   virtual void prepare() override;
   virtual void cleanup() override;
@@ -25,13 +26,12 @@ private:
     VkDeviceMemory  memory;
   };
   BufferObject createBuffer(uint32_t size, VkBufferUsageFlags usage);
-  VkPipelineShaderStageCreateInfo loadShaderModule(const char* fileName, VkShaderStageFlagBits stage);
   
 
   BufferObject m_vertexBuffer;
   BufferObject m_indexBuffer;
 
   VkPipelineLayout m_pipelineLayout;
-  VkPipeline   m_pipeline;
+  VkPipeline   m_pipeline;   // m_pipelineCache が所有する
   uint32_t m_indexCount;
 };
\ No newline at end of file
@@ -1,6 +1,5 @@
 ﻿#include "CubeApp.h"
 
-#include <fstream>
 #include <array>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -14,6 +13,7 @@ void CubeApp::prepare()
 {
   makeCubeGeometry();
   prepareUniformBuffers();
+  updateShaderParameters();
   prepareDescriptorSetLayout();
   prepareDescriptorPool();
 
@@ -22,101 +22,6 @@ void CubeApp::prepare()
   m_sampler = createSampler();
   prepareDescriptorSet();
 
-  // 頂点の入力設定
-  VkVertexInputBindingDescription inputBinding{
-    0,                          // binding
-    sizeof(CubeVertex),         // stride
-    VK_VERTEX_INPUT_RATE_VERTEX // inputRate
-  };
-  array<VkVertexInputAttributeDescription, 3> inputAttribs{
-    {
-      { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(CubeVertex, pos)},
-      { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(CubeVertex, color)},
-      { 2, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(CubeVertex, uv)},
-    }
-  };
-  VkPipelineVertexInputStateCreateInfo vertexInputCI{};
-  vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertexInputCI.vertexBindingDescriptionCount = 1;
-  vertexInputCI.pVertexBindingDescriptions = &inputBinding;
-  vertexInputCI.vertexAttributeDescriptionCount = uint32_t(inputAttribs.size());
-  vertexInputCI.pVertexAttributeDescriptions = inputAttribs.data();
-
-  // ブレンディングの設定
-  const auto colorWriteAll = \
-    VK_COLOR_COMPONENT_R_BIT | \
-    VK_COLOR_COMPONENT_G_BIT | \
-    VK_COLOR_COMPONENT_B_BIT | \
-    VK_COLOR_COMPONENT_A_BIT;
-  VkPipelineColorBlendAttachmentState blendAttachment{};
-  blendAttachment.blendEnable = VK_TRUE;
-  blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-  blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
-  blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-  blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-  blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-  blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-  blendAttachment.colorWriteMask = colorWriteAll;
-  VkPipelineColorBlendStateCreateInfo cbCI{};
-  cbCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-  cbCI.attachmentCount = 1;
-  cbCI.pAttachments = &blendAttachment;
-
-  // ビューポートの設定
-  VkViewport viewport;
-  {
-    viewport.x = 0.0f;
-    viewport.y = float(m_swapchainExtent.height);
-    viewport.width = float(m_swapchainExtent.width);
-    viewport.height = -1.0f * float(m_swapchainExtent.height);
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-  }
-  VkRect2D scissor = {
-    { 0,0},// offset
-    m_swapchainExtent
-  };
-  VkPipelineViewportStateCreateInfo viewportCI{};
-  viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-  viewportCI.viewportCount = 1;
-  viewportCI.pViewports = &viewport;
-  viewportCI.scissorCount = 1;
-  viewportCI.pScissors = &scissor;
-
-  // プリミティブトポロジー設定
-  VkPipelineInputAssemblyStateCreateInfo inputAssemblyCI{};
-  inputAssemblyCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssemblyCI.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-
-
-  // ラスタライザーステート設定
-  VkPipelineRasterizationStateCreateInfo rasterizerCI{};
-  rasterizerCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-  rasterizerCI.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterizerCI.cullMode = VK_CULL_MODE_NONE;
-  rasterizerCI.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-  rasterizerCI.lineWidth = 1.0f;
-
-  // マルチサンプル設定
-  VkPipelineMultisampleStateCreateInfo multisampleCI{};
-  multisampleCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampleCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-
-  // デプスステンシルステート設定
-  VkPipelineDepthStencilStateCreateInfo depthStencilCI{};
-  depthStencilCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-  depthStencilCI.depthTestEnable = VK_TRUE;
-  depthStencilCI.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-  depthStencilCI.depthWriteEnable = VK_TRUE;
-  depthStencilCI.stencilTestEnable = VK_FALSE;
-
-  // シェーダーバイナリの読み込み
-  vector<VkPipelineShaderStageCreateInfo> shaderStages
-  {
-    loadShaderModule("shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT),
-    loadShaderModule("shader.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT)
-  };
-
   // パイプラインレイアウト
   VkPipelineLayoutCreateInfo pipelineLayoutCI{};
   pipelineLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -124,42 +29,33 @@ void CubeApp::prepare()
   pipelineLayoutCI.pSetLayouts = &m_descriptorSetLayout;
   vkCreatePipelineLayout(m_device, &pipelineLayoutCI, nullptr, &m_pipelineLayout);
 
-  // パイプラインの構築
-  VkGraphicsPipelineCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  ci.stageCount = uint32_t(shaderStages.size());
-  ci.pStages = shaderStages.data();
-  ci.pInputAssemblyState = &inputAssemblyCI;
-  ci.pVertexInputState = &vertexInputCI;
-  ci.pRasterizationState = &rasterizerCI;
-  ci.pDepthStencilState = &depthStencilCI;
-  ci.pMultisampleState = &multisampleCI;
-  ci.pViewportState = &viewportCI;
-  ci.pColorBlendState = &cbCI;
-  ci.renderPass = m_renderPass;
-  ci.layout = m_pipelineLayout;
-  vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipeline);
-
-  // ShaderModule はもう不要のため破棄
-  for (const auto& v : shaderStages)
-  {
-    vkDestroyShaderModule(m_device, v.module, nullptr);
-  }
+  // パイプライン
+  PipelineDesc desc;
+  desc.vertexShader = "shader.vert.spv";
+  desc.fragmentShader = "shader.frag.spv";
+  desc.vertexStride = sizeof(CubeVertex);
+  desc.vertexAttributes = {
+    { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(CubeVertex, pos)},
+    { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(CubeVertex, color)},
+    { 2, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(CubeVertex, uv)},
+  };
+  // 閉じた立方体なので裏面はカリングする. (インデックスは外から見て時計回りに並んでいる)
+  desc.cullMode = VK_CULL_MODE_BACK_BIT;
+  desc.frontFace = VK_FRONT_FACE_CLOCKWISE;
+  desc.renderPass = m_renderPass;
+  desc.layout = m_pipelineLayout;
+  m_pipeline = m_pipelineCache.getPipeline(desc);
 }
 void CubeApp::cleanup()
 {
-  for (auto& v : m_uniformBuffers)
-  {
-    vkDestroyBuffer(m_device, v.buffer, nullptr);
-    vkFreeMemory(m_device, v.memory, nullptr);
-  }
+  vkDestroyBuffer(m_device, m_uniformBuffer.buffer, nullptr);
+  vkFreeMemory(m_device, m_uniformBuffer.memory, nullptr);
   vkDestroySampler(m_device, m_sampler, nullptr);
   vkDestroyImage(m_device, m_texture.image, nullptr);
   vkDestroyImageView(m_device, m_texture.view, nullptr);
   vkFreeMemory(m_device, m_texture.memory, nullptr);
 
   vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
-  vkDestroyPipeline(m_device, m_pipeline, nullptr);
 
   vkFreeMemory(m_device, m_vertexBuffer.memory, nullptr);
   vkFreeMemory(m_device, m_indexBuffer.memory, nullptr);
@@ -170,21 +66,31 @@ void CubeApp::cleanup()
   vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
 }
 
-void CubeApp::makeCommand(VkCommandBuffer command)
+void CubeApp::onSwapchainRecreated()
+{
+  // アスペクト比が変わるので行列を更新する.
+  updateShaderParameters();
+}
+
+void CubeApp::updateShaderParameters()
 {
-  // ユニフォームバッファの中身を更新する.
+  // 行列の合成は頂点ごとではなくここで 1 度だけ行う.
+  auto mtxWorld = glm::rotate(glm::identity<glm::mat4>(), glm::radians(45.0f), glm::vec3(0, 1, 0));
+  auto mtxView = lookAtRH(vec3(0.0f, 3.0f, 5.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+  auto mtxProj = perspective(glm::radians(60.0f), float(m_swapchainExtent.width) / float(m_swapchainExtent.height), 0.01f, 100.0f);
   ShaderParameters shaderParam{};
-  shaderParam.mtxWorld = glm::rotate(glm::identity<glm::mat4>(), glm::radians(45.0f), glm::vec3(0, 1, 0));
-  shaderParam.mtxView = lookAtRH(vec3(0.0f, 3.0f, 5.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
-  shaderParam.mtxProj = perspective(glm::radians(60.0f), 640.0f / 480, 0.01f, 100.0f);
+  shaderParam.mtxPVW = mtxProj * mtxView * mtxWorld;
   {
-    auto memory = m_uniformBuffers[m_imageIndex].memory;
+    auto memory = m_uniformBuffer.memory;
     void* p;
     vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
     memcpy(p, &shaderParam, sizeof(shaderParam));
     vkUnmapMemory(m_device, memory);
   }
+}
 
+void CubeApp::makeCommand(VkCommandBuffer command)
+{
   // 作成したパイプラインをセット
   vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
 
@@ -195,7 +101,7 @@ void CubeApp::makeCommand(VkCommandBuffer command)
 
   // ディスクリプタセットをセット
   VkDescriptorSet descriptorSets[] = {
-    m_descriptorSet[m_imageIndex]
+    m_descriptorSet
   };
   vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
 
@@ -286,12 +192,8 @@ void CubeApp::makeCubeGeometry()
 
 void CubeApp::prepareUniformBuffers()
 {
-  m_uniformBuffers.resize(m_swapchainViews.size());
-  for (auto& v : m_uniformBuffers)
-  {
-    VkMemoryPropertyFlags uboFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    v = createBuffer(sizeof(ShaderParameters), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags );
-  }
+  VkMemoryPropertyFlags uboFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  m_uniformBuffer = createBuffer(sizeof(ShaderParameters), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags );
 }
 void CubeApp::prepareDescriptorSetLayout()
 {
@@ -319,14 +221,14 @@ void CubeApp::prepareDescriptorSetLayout()
 void CubeApp::prepareDescriptorPool()
 {
   array<VkDescriptorPoolSize, 2> descPoolSize;
-  descPoolSize[0].descriptorCount = uint32_t(m_uniformBuffers.size());
+  descPoolSize[0].descriptorCount = 1;
   descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  descPoolSize[1].descriptorCount = uint32_t(m_uniformBuffers.size());
+  descPoolSize[1].descriptorCount = 1;
   descPoolSize[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 
   VkDescriptorPoolCreateInfo ci{};
   ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  ci.maxSets = uint32_t(m_uniformBuffers.size());
+  ci.maxSets = 1;
   ci.poolSizeCount = uint32_t(descPoolSize.size());
   ci.pPoolSizes = descPoolSize.data();
   vkCreateDescriptorPool(m_device, &ci, nullptr, &m_descriptorPool);
@@ -334,53 +236,44 @@ void CubeApp::prepareDescriptorPool()
 
 void CubeApp::prepareDescriptorSet()
 {
-  vector<VkDescriptorSetLayout> layouts;
-  for (int i = 0; i<int(m_uniformBuffers.size()); ++i)
-  {
-    layouts.push_back(m_descriptorSetLayout);
-  }
   VkDescriptorSetAllocateInfo ai{};
   ai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
   ai.descriptorPool = m_descriptorPool;
-  ai.descriptorSetCount = uint32_t(m_uniformBuffers.size());
-  ai.pSetLayouts = layouts.data();
-  m_descriptorSet.resize(m_uniformBuffers.size());
-  vkAllocateDescriptorSets(m_device, &ai, m_descriptorSet.data());
+  ai.descriptorSetCount = 1;
+  ai.pSetLayouts = &m_descriptorSetLayout;
+  vkAllocateDescriptorSets(m_device, &ai, &m_descriptorSet);
 
   // ディスクリプタセットへ書き込み.
-  for (int i = 0; i<int(m_uniformBuffers.size()); ++i)
-  {
-    VkDescriptorBufferInfo descUBO{};
-    descUBO.buffer = m_uniformBuffers[i].buffer;
-    descUBO.offset = 0;
-    descUBO.range = VK_WHOLE_SIZE;
-
-    VkDescriptorImageInfo  descImage{};
-    descImage.imageView = m_texture.view;
-    descImage.sampler = m_sampler;
-    descImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    VkWriteDescriptorSet ubo{};
-    ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    ubo.dstBinding = 0;
-    ubo.descriptorCount = 1;
-    ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    ubo.pBufferInfo = &descUBO;
-    ubo.dstSet = m_descriptorSet[i];
-
-    VkWriteDescriptorSet tex{};
-    tex.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    tex.dstBinding = 1;
-    tex.descriptorCount = 1;
-    tex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    tex.pImageInfo = &descImage;
-    tex.dstSet = m_descriptorSet[i];
-
-    vector<VkWriteDescriptorSet> writeSets = {
-      ubo, tex
-    };
-    vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
-  }
+  VkDescriptorBufferInfo descUBO{};
+  descUBO.buffer = m_uniformBuffer.buffer;
+  descUBO.offset = 0;
+  descUBO.range = VK_WHOLE_SIZE;
+
+  VkDescriptorImageInfo  descImage{};
+  descImage.imageView = m_texture.view;
+  descImage.sampler = m_sampler;
+  descImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  VkWriteDescriptorSet ubo{};
+  ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  ubo.dstBinding = 0;
+  ubo.descriptorCount = 1;
+  ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  ubo.pBufferInfo = &descUBO;
+  ubo.dstSet = m_descriptorSet;
+
+  VkWriteDescriptorSet tex{};
+  tex.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  tex.dstBinding = 1;
+  tex.descriptorCount = 1;
+  tex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  tex.pImageInfo = &descImage;
+  tex.dstSet = m_descriptorSet;
+
+  vector<VkWriteDescriptorSet> writeSets = {
+    ubo, tex
+  };
+  vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
 }
 
 CubeApp::BufferObject CubeApp::createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags)
@@ -409,33 +302,6 @@ CubeApp::BufferObject CubeApp::createBuffer(uint32_t size, VkBufferUsageFlags us
   return obj;
 }
 
-VkPipelineShaderStageCreateInfo CubeApp::loadShaderModule(const char* fileName, VkShaderStageFlagBits stage)
-{
-  ifstream infile(fileName, std::ios::binary);
-  if (!infile)
-  {
-    OutputDebugStringA("file not found.\n");
-    DebugBreak();
-  }
-  vector<char> filedata;
-  filedata.resize(uint32_t(infile.seekg(0, ifstream::end).tellg()));
-  infile.seekg(0, ifstream::beg).read(filedata.data(), filedata.size());
-
-  VkShaderModule shaderModule;
-  VkShaderModuleCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  ci.pCode = reinterpret_cast<uint32_t*>(filedata.data());
-  ci.codeSize = filedata.size();
-  vkCreateShaderModule(m_device, &ci, nullptr, &shaderModule);
-
-  VkPipelineShaderStageCreateInfo shaderStageCI{};
-  shaderStageCI.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shaderStageCI.stage = stage;
-  shaderStageCI.module = shaderModule;
-  shaderStageCI.pName = "main";
-  return shaderStageCI;
-}
-
 VkSampler CubeApp::createSampler()
 {
   VkSampler sampler;
@@ -499,30 +365,15 @@ CubeApp::TextureObject CubeApp::createTexture(const char* fileName)
   VkBufferImageCopy copyRegion{};
   copyRegion.imageExtent = { uint32_t(width), uint32_t(height), 1 };
   copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-  VkCommandBuffer command;
-  {
-    VkCommandBufferAllocateInfo ai{};
-    ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    ai.commandBufferCount = 1;
-    ai.commandPool = m_commandPool;
-    ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkAllocateCommandBuffers(m_device, &ai, &command);
-  }
-
-  VkCommandBufferBeginInfo commandBI{};
-  commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  vkBeginCommandBuffer(command, &commandBI);
-  setImageMemoryBarrier(command, texture.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  auto command = beginUploadCommand();
+  beginImageUpload(texture.image, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+  flushUploadBarriers(command);
   vkCmdCopyBufferToImage(command, stagingBuffer.buffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
 
-  setImageMemoryBarrier(command, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-  vkEndCommandBuffer(command);
-
-  VkSubmitInfo submitInfo{};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &command;
-  vkQueueSubmit(m_deviceQueue, 1, &submitInfo, VK_NULL_HANDLE);
+  // 転送キューからグラフィックスキューへ渡し、シェーダーから読める状態にする.
+  releaseUploadedImage(texture.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+  auto uploadValue = submitUploadCommand(command);
   {
     // テクスチャ参照用のビューを生成
     VkImageViewCreateInfo ci{};
@@ -542,73 +393,12 @@ CubeApp::TextureObject CubeApp::createTexture(const char* fileName)
     vkCreateImageView(m_device, &ci, nullptr, &texture.view);
   }
 
-  vkDeviceWaitIdle(m_device);
-  vkFreeCommandBuffers(m_device, m_commandPool, 1, &command);
-
-  // ステージングバッファ解放.
-  vkFreeMemory(m_device, stagingBuffer.memory, nullptr);
-  vkDestroyBuffer(m_device, stagingBuffer.buffer, nullptr);
+  // ステージングバッファは転送の完了後に解放する.
+  deferRelease(m_uploadTimeline, uploadValue, [this, stagingBuffer]() {
+    vkFreeMemory(m_device, stagingBuffer.memory, nullptr);
+    vkDestroyBuffer(m_device, stagingBuffer.buffer, nullptr);
+  });
 
   stbi_image_free(pImage);
   return texture;
 }
-
-void CubeApp::setImageMemoryBarrier(
-  VkCommandBuffer command,
-  VkImage image,
-  VkImageLayout oldLayout, VkImageLayout newLayout)
-{
-  VkImageMemoryBarrier imb{};
-  imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  imb.oldLayout = oldLayout;
-  imb.newLayout = newLayout;
-  imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  imb.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-  imb.image = image;
-
-  VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-  VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-
-  switch (oldLayout)
-  {
-  case VK_IMAGE_LAYOUT_UNDEFINED:
-    imb.srcAccessMask = 0;
-    break;
-  case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-    imb.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    break;
-  }
-
-  switch (newLayout)
-  {
-  case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
-    imb.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    break;
-  case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-    imb.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    break;
-  case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
-    imb.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    break;
-  }
-
-  //srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;  // パイプライン中でリソースへの書込み最終のステージ.
-  //dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;  // パイプライン中で次にリソースに書き込むステージ.
-
-  vkCmdPipelineBarrier(
-    command,
-    srcStage,
-    dstStage,
-    0,
-    0,  // memoryBarrierCount
-    nullptr,
-    0,  // bufferMemoryBarrierCount
-    nullptr,
-    1,  // imageMemoryBarrierCount
-    &imb);
-}
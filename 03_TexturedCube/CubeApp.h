@@ -1,4 +1,4 @@
-#pragma once
+﻿#pragma once
 
 #include "../common/vkappbase.h"
 #include "glm/glm.hpp"
@@ -6,7 +6,8 @@
 class CubeApp : public VulkanAppBase
 {
 public:
-  CubeApp() : VulkanAppBase() { }
+  // 毎フレーム同じコマンドなので、静的コマンドモードで記録を 1 度だけにする.
+  CubeApp() : VulkanAppBase() { setStaticCommandMode(true); }
 
   virtual void prepare() override;
   virtual void cleanup() override;
@@ -33,34 +34,35 @@ private:
   };
   struct ShaderParameters
   {
-    glm::mat4 mtxWorld;
-    glm::mat4 mtxView;
-    glm::mat4 mtxProj;
+    glm::mat4 mtxPVW;   // proj * view * world を CPU 側で合成済みのもの
   };
+  virtual void onSwapchainRecreated() override;
+
   void makeCubeGeometry();
   void prepareUniformBuffers();
+  void updateShaderParameters();
   void prepareDescriptorSetLayout();
   void prepareDescriptorPool();
   void prepareDescriptorSet();
 
   BufferObject createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-  VkPipelineShaderStageCreateInfo loadShaderModule(const char* fileName, VkShaderStageFlagBits stage);
   VkSampler createSampler();
   TextureObject createTexture(const char* fileName);
-  void setImageMemoryBarrier( VkCommandBuffer command, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
 
   BufferObject m_vertexBuffer;
   BufferObject m_indexBuffer;
-  std::vector<BufferObject> m_uniformBuffers;
+  // シーンは静的なので、ユニフォームバッファは 1 つを全フレームで共有する.
+  // (内容を変えるのは GPU の処理がない prepare とスワップチェイン作り直しの時だけ)
+  BufferObject m_uniformBuffer;
   TextureObject m_texture;
 
   VkDescriptorSetLayout m_descriptorSetLayout;
   VkDescriptorPool  m_descriptorPool;
-  std::vector<VkDescriptorSet> m_descriptorSet;
+  VkDescriptorSet m_descriptorSet;
 
   VkSampler m_sampler;
 
   VkPipelineLayout m_pipelineLayout;
-  VkPipeline   m_pipeline;
+  VkPipeline   m_pipeline;   // m_pipelineCache が所有する
   uint32_t m_indexCount;
 };
\ No newline at end of file
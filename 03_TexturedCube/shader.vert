@@ -8,9 +8,7 @@ layout(location=1) out vec2 outUV;
 
 layout(binding=0) uniform Matrices
 {
-  mat4 world;
-  mat4 view;
-  mat4 proj;
+  mat4 pvw;
 };
 
 out gl_PerVertex
@@ -20,7 +18,6 @@ out gl_PerVertex
 
 void main()
 {
-  mat4 pvw = proj * view * world;
   gl_Position = pvw * vec4(inPos, 1.0);
   outColor = vec4(inColor, 1.0);
   outUV = inUV;
@@ -1,7 +1,7 @@
 ﻿#include "ModelApp.h"
 
 #include <fstream>
-#include <array>
+#include <algorithm>
 #include <glm/gtc/matrix_transform.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -30,6 +30,13 @@ void ModelApp::prepare()
 
   makeModelGeometry(document, glbResourceReader);
   makeModelMaterial(document, glbResourceReader);
+  m_model.mtxWorld = glm::identity<glm::mat4>();
+  prepareDrawList();
+
+  // ディスクリプタインデックスが使える環境では全テクスチャを 1 つの配列にまとめる.
+  // 使えない場合は従来通りマテリアルごとのディスクリプタセットを使用.
+  m_useBindless = isDescriptorIndexingSupported() &&
+    m_model.materials.size() <= getBindlessTextureCapacity();
 
   prepareUniformBuffers();
   prepareDescriptorSetLayout();
@@ -38,192 +45,123 @@ void ModelApp::prepare()
   m_sampler = createSampler();
   prepareDescriptorSet();
 
-  // 頂点の入力設定
-  VkVertexInputBindingDescription inputBinding{
-    0,                          // binding
-    sizeof(Vertex),         // stride
-    VK_VERTEX_INPUT_RATE_VERTEX // inputRate
-  };
-  array<VkVertexInputAttributeDescription, 3> inputAttribs{
-    {
-      { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos)},
-      { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color)},
-      { 2, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, uv)},
-    }
-  };
-  VkPipelineVertexInputStateCreateInfo vertexInputCI{};
-  vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertexInputCI.vertexBindingDescriptionCount = 1;
-  vertexInputCI.pVertexBindingDescriptions = &inputBinding;
-  vertexInputCI.vertexAttributeDescriptionCount = uint32_t(inputAttribs.size());
-  vertexInputCI.pVertexAttributeDescriptions = inputAttribs.data();
-
-
-  // ビューポートの設定
-  VkViewport viewport;
-  {
-    viewport.x = 0.0f;
-    viewport.y = float(m_swapchainExtent.height);
-    viewport.width = float(m_swapchainExtent.width);
-    viewport.height = -1.0f * float(m_swapchainExtent.height);
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-  }
-  VkRect2D scissor = {
-    { 0,0},// offset
-    m_swapchainExtent
-  };
-  VkPipelineViewportStateCreateInfo viewportCI{};
-  viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-  viewportCI.viewportCount = 1;
-  viewportCI.pViewports = &viewport;
-  viewportCI.scissorCount = 1;
-  viewportCI.pScissors = &scissor;
-
-  // プリミティブトポロジー設定
-  VkPipelineInputAssemblyStateCreateInfo inputAssemblyCI{};
-  inputAssemblyCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssemblyCI.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-
-
-  // ラスタライザーステート設定
-  VkPipelineRasterizationStateCreateInfo rasterizerCI{};
-  rasterizerCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-  rasterizerCI.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterizerCI.cullMode = VK_CULL_MODE_NONE;
-  rasterizerCI.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-  rasterizerCI.lineWidth = 1.0f;
-
-  // マルチサンプル設定
-  VkPipelineMultisampleStateCreateInfo multisampleCI{};
-  multisampleCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampleCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-
   // パイプラインレイアウト
   VkPipelineLayoutCreateInfo pipelineLayoutCI{};
   pipelineLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipelineLayoutCI.setLayoutCount = 1;
-  pipelineLayoutCI.pSetLayouts = &m_descriptorSetLayout;
+  VkDescriptorSetLayout setLayouts[] = {
+    m_descriptorSetLayoutFrame, m_descriptorSetLayoutMaterial
+  };
+  pipelineLayoutCI.setLayoutCount = _countof(setLayouts);
+  pipelineLayoutCI.pSetLayouts = setLayouts;
+  // 描画ごとのワールド行列・マテリアル番号はプッシュ定数で渡す.
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof(DrawParameters);
+  pipelineLayoutCI.pushConstantRangeCount = 1;
+  pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
   vkCreatePipelineLayout(m_device, &pipelineLayoutCI, nullptr, &m_pipelineLayout);
 
-  // 不透明用: パイプラインの構築
-  {
-    // ブレンディングの設定
-    const auto colorWriteAll = \
-      VK_COLOR_COMPONENT_R_BIT | \
-      VK_COLOR_COMPONENT_G_BIT | \
-      VK_COLOR_COMPONENT_B_BIT | \
-      VK_COLOR_COMPONENT_A_BIT;
-    VkPipelineColorBlendAttachmentState blendAttachment{};
-    blendAttachment.blendEnable = VK_TRUE;
-    blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-    blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
-    blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-    blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-    blendAttachment.colorWriteMask = colorWriteAll;
-    VkPipelineColorBlendStateCreateInfo cbCI{};
-    cbCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    cbCI.attachmentCount = 1;
-    cbCI.pAttachments = &blendAttachment;
-
-    // デプスステンシルステート設定
-    VkPipelineDepthStencilStateCreateInfo depthStencilCI{};
-    depthStencilCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencilCI.depthTestEnable = VK_TRUE;
-    depthStencilCI.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-    depthStencilCI.depthWriteEnable = VK_TRUE;
-    depthStencilCI.stencilTestEnable = VK_FALSE;
-
-    // シェーダーバイナリの読み込み
-    vector<VkPipelineShaderStageCreateInfo> shaderStages
+  // マテリアルごとに使うパイプラインを決める. 同じ組み合わせのパイプラインはキャッシュで 1 つにまとまる.
+  // 使う記述を先に全部集めて並列に作成し、マテリアルにはキャッシュから引いたものを設定する.
+  vector<PipelineDesc> pipelineDescs;
+  vector<VkPipeline*> pipelineTargets;
+  for (auto& material : m_model.materials)
+  {
+    PipelineKey key{ material.alphaMode, 0.0f, material.doubleSided, false };
+    if (material.alphaMode == Microsoft::glTF::ALPHA_MASK)
     {
-      loadShaderModule("shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT),
-      loadShaderModule("shaderOpaque.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT)
-    };
-    // パイプラインの構築
-    VkGraphicsPipelineCreateInfo ci{};
-    ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    ci.stageCount = uint32_t(shaderStages.size());
-    ci.pStages = shaderStages.data();
-    ci.pInputAssemblyState = &inputAssemblyCI;
-    ci.pVertexInputState = &vertexInputCI;
-    ci.pRasterizationState = &rasterizerCI;
-    ci.pDepthStencilState = &depthStencilCI;
-    ci.pMultisampleState = &multisampleCI;
-    ci.pViewportState = &viewportCI;
-    ci.pColorBlendState = &cbCI;
-    ci.renderPass = m_renderPass;
-    ci.layout = m_pipelineLayout;
-    vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipelineOpaque);
-
-    // ShaderModule はもう不要のため破棄
-    for (const auto& v : shaderStages)
+      key.alphaCutoff = material.alphaCutoff;
+    }
+    pipelineDescs.push_back(makePipelineDesc(key));
+    pipelineTargets.push_back(&material.pipeline);
+
+    material.depthPipeline = VK_NULL_HANDLE;
+    if (m_depthPrepass && material.alphaMode != Microsoft::glTF::ALPHA_BLEND)
     {
-      vkDestroyShaderModule(m_device, v.module, nullptr);
+      key.depthOnly = true;
+      pipelineDescs.push_back(makePipelineDesc(key));
+      pipelineTargets.push_back(&material.depthPipeline);
     }
   }
+  m_pipelineCache.compile(pipelineDescs, m_jobSystem);
+  for (size_t i = 0; i < pipelineDescs.size(); ++i)
+  {
+    *pipelineTargets[i] = m_pipelineCache.getPipeline(pipelineDescs[i]);
+  }
+}
+
+PipelineDesc ModelApp::makePipelineDesc(const PipelineKey& key)
+{
+  using namespace Microsoft::glTF;
+  // 不透明の深度プリパスは位置だけを読み、フラグメントシェーダーを持たない.
+  auto positionOnly = key.depthOnly && key.alphaMode == ALPHA_OPAQUE;
+
+  PipelineDesc desc;
+  desc.vertexShader = positionOnly ? "shaderDepth.vert.spv" : "shader.vert.spv";
+  desc.vertexStride = sizeof(Vertex);
+  desc.vertexAttributes = {
+    { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos)},
+    { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color)},
+    { 2, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, uv)},
+  };
+  if (positionOnly)
+  {
+    desc.vertexAttributes.resize(1);
+  }
 
-  // 半透明用: パイプラインの構築
-  {
-    // ブレンディングの設定
-    const auto colorWriteAll = \
-      VK_COLOR_COMPONENT_R_BIT | \
-      VK_COLOR_COMPONENT_G_BIT | \
-      VK_COLOR_COMPONENT_B_BIT | \
-      VK_COLOR_COMPONENT_A_BIT;
-    VkPipelineColorBlendAttachmentState blendAttachment{};
-    blendAttachment.blendEnable = VK_TRUE;
-    blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-    blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-    blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-    blendAttachment.colorWriteMask = colorWriteAll;
-    VkPipelineColorBlendStateCreateInfo cbCI{};
-    cbCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    cbCI.attachmentCount = 1;
-    cbCI.pAttachments = &blendAttachment;
-
-    // デプスステンシルステート設定
-    VkPipelineDepthStencilStateCreateInfo depthStencilCI{};
-    depthStencilCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencilCI.depthTestEnable = VK_TRUE;
-    depthStencilCI.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-    depthStencilCI.depthWriteEnable = VK_FALSE;
-    depthStencilCI.stencilTestEnable = VK_FALSE;
-
-    // シェーダーバイナリの読み込み
-    vector<VkPipelineShaderStageCreateInfo> shaderStages
+  // マスクのしきい値はシェーダーに特殊化する. (深度プリパスもメインパスと同じシェーダー・しきい値で判定する)
+  if (!positionOnly)
+  {
+    string fragName = "shaderOpaque";
+    if (key.alphaMode == ALPHA_MASK)
     {
-      loadShaderModule("shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT),
-      loadShaderModule("shaderAlpha.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT)
-    };
-    // パイプラインの構築
-    VkGraphicsPipelineCreateInfo ci{};
-    ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    ci.stageCount = uint32_t(shaderStages.size());
-    ci.pStages = shaderStages.data();
-    ci.pInputAssemblyState = &inputAssemblyCI;
-    ci.pVertexInputState = &vertexInputCI;
-    ci.pRasterizationState = &rasterizerCI;
-    ci.pDepthStencilState = &depthStencilCI;
-    ci.pMultisampleState = &multisampleCI;
-    ci.pViewportState = &viewportCI;
-    ci.pColorBlendState = &cbCI;
-    ci.renderPass = m_renderPass;
-    ci.layout = m_pipelineLayout;
-    vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipelineAlpha);
-
-    // ShaderModule はもう不要のため破棄
-    for (const auto& v : shaderStages)
+      fragName = "shaderMask";
+      desc.addFragmentConstant(key.alphaCutoff);
+    }
+    else if (key.alphaMode == ALPHA_BLEND)
     {
-      vkDestroyShaderModule(m_device, v.module, nullptr);
+      fragName = "shaderAlpha";
     }
+    desc.fragmentShader = fragName + (m_useBindless ? "Bindless.frag.spv" : ".frag.spv");
+  }
+
+  // glTF は反時計回りが表. 両面表示のマテリアル以外は裏面をカリングする.
+  desc.cullMode = key.doubleSided ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT;
+  desc.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+  // 半透明のみアルファでブレンドし、深度は書き込まない.
+  if (key.depthOnly)
+  {
+    desc.depthCompareOp = VK_COMPARE_OP_LESS;
+  }
+  else if (key.alphaMode == ALPHA_BLEND)
+  {
+    desc.blend = PipelineDesc::Blend::Alpha;
+    desc.depthWrite = VK_FALSE;
+  }
+  else if (m_depthPrepass)
+  {
+    // 深度はプリパスで確定しているので、一致したフラグメントだけを描き、書き込みはしない.
+    desc.depthCompareOp = VK_COMPARE_OP_EQUAL;
+    desc.depthWrite = VK_FALSE;
   }
+
+  // 深度プリパスはカラーを持たない、深度だけのレンダーパスで使う.
+  desc.renderPass = m_renderPass;
+  if (key.depthOnly)
+  {
+    RenderGraph::RenderPassDesc passDesc{};
+    passDesc.depth = {
+      m_depthFormat, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+    };
+    desc.renderPass = m_renderGraph.getRenderPass(passDesc);
+    desc.colorAttachmentCount = 0;
+  }
+  desc.layout = m_pipelineLayout;
+  return desc;
 }
+
 void ModelApp::cleanup()
 {
   for (auto& v : m_uniformBuffers)
@@ -234,8 +172,6 @@ void ModelApp::cleanup()
   vkDestroySampler(m_device, m_sampler, nullptr);
 
   vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
-  vkDestroyPipeline(m_device, m_pipelineOpaque, nullptr);
-  vkDestroyPipeline(m_device, m_pipelineAlpha, nullptr);
 
   for (auto& mesh : m_model.meshes)
   {
@@ -243,8 +179,6 @@ void ModelApp::cleanup()
     vkFreeMemory(m_device, mesh.indexBuffer.memory, nullptr);
     vkDestroyBuffer(m_device, mesh.vertexBuffer.buffer, nullptr);
     vkDestroyBuffer(m_device, mesh.indexBuffer.buffer, nullptr);
-    uint32_t count = uint32_t(mesh.descriptorSet.size());
-    mesh.descriptorSet.clear();
   }
   for (auto& material : m_model.materials)
   {
@@ -252,78 +186,254 @@ void ModelApp::cleanup()
     vkDestroyImage(m_device, material.texture.image, nullptr);
     vkDestroyImageView(m_device, material.texture.view, nullptr);
   }
-  vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
-  vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
+  m_descriptorSetFrame.clear();
+  m_descriptorAllocator.terminate();
+  vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayoutFrame, nullptr);
+  vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayoutMaterial, nullptr);
 }
 
-void ModelApp::makeCommand(VkCommandBuffer command)
+void ModelApp::declareRequirements(Requirements& req)
 {
-  using namespace Microsoft::glTF;
+  // bindless テクスチャに使う機能. 使えなければマテリアルごとのディスクリプタセットで描画する.
+  req.optionalFeatures.features.features.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+  req.optionalFeatures.vulkan12.runtimeDescriptorArray = VK_TRUE;
+  req.optionalFeatures.vulkan12.descriptorBindingPartiallyBound = VK_TRUE;
+  req.optionalFeatures.vulkan12.descriptorBindingVariableDescriptorCount = VK_TRUE;
+}
 
+bool ModelApp::parseOption(const std::wstring& key, const std::wstring& value)
+{
+  if (key == L"depth-prepass")
+  {
+    setDepthPrepass(true);
+    return true;
+  }
+  return false;
+}
+
+void ModelApp::buildRenderGraph(RenderGraph& graph, RenderGraph::Handle backBuffer, RenderGraph::Handle depthBuffer)
+{
+  if (!m_depthPrepass)
+  {
+    addMainPass(graph, backBuffer, depthBuffer);
+    return;
+  }
+  graph.addPass("depthPrepass", [&](RenderGraph::PassBuilder& builder) {
+    builder.depthAttachment(depthBuffer, VK_ATTACHMENT_LOAD_OP_CLEAR);
+  }, [this](VkCommandBuffer command, const RenderGraph::PassContext&) {
+    setViewportAndScissor(command);
+    recordDepthDraws(command);
+  });
+  addMainPass(graph, backBuffer, depthBuffer, true);
+}
+
+void ModelApp::onBeginFrame()
+{
   // ユニフォームバッファの中身を更新する.
+  // 行列の合成は頂点ごとではなくここで 1 度だけ行う.
+  auto mtxView = lookAtRH(vec3(0.0f, 1.5f, -1.0f), vec3(0.0f, 1.25f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+  auto mtxProj = perspective(glm::radians(45.0f), float(m_swapchainExtent.width) / float(m_swapchainExtent.height), 0.01f, 100.0f);
   ShaderParameters shaderParam{};
-  shaderParam.mtxWorld = glm::identity<glm::mat4>();
-  shaderParam.mtxView = lookAtRH(vec3(0.0f, 1.5f, -1.0f), vec3(0.0f, 1.25f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
-  shaderParam.mtxProj = perspective(glm::radians(45.0f), 640.0f / 480, 0.01f, 100.0f);
+  shaderParam.mtxViewProj = mtxProj * mtxView;
   {
-    auto memory = m_uniformBuffers[m_imageIndex].memory;
+    auto memory = m_uniformBuffers[m_frameIndex].memory;
     void* p;
     vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
     memcpy(p, &shaderParam, sizeof(shaderParam));
     vkUnmapMemory(m_device, memory);
   }
+}
 
-  for (auto mode : { ALPHA_OPAQUE, ALPHA_MASK, ALPHA_BLEND })
+void ModelApp::makeCommand(VkCommandBuffer command)
+{
+  recordDraws(command, 0, uint32_t(m_drawList.size()));
+}
+
+void ModelApp::makeCommandSecondary(VkCommandBuffer command, uint32_t workerIndex, uint32_t workerCount)
+{
+  // 描画リストを連続した範囲に等分する. 実行順はワーカー順なので描画順は変わらない.
+  auto drawCount = uint32_t(m_drawList.size());
+  auto first = drawCount * workerIndex / workerCount;
+  auto last = drawCount * (workerIndex + 1) / workerCount;
+  recordDraws(command, first, last);
+}
+
+void ModelApp::prepareDrawList()
+{
+  using namespace Microsoft::glTF;
+  auto modeRank = [](AlphaMode mode) {
+    switch (mode)
+    {
+    case ALPHA_OPAQUE: return 0;
+    case ALPHA_MASK: return 1;
+    default: return 2;
+    }
+  };
+
+  // 不透明 → マスク → 半透明の順に並べる.
+  // マスクはアルファテストで深度の書き込みが遅れるため、不透明の後に描いて不透明の早期深度テストを活かす.
+  // 半透明以外はパイプライン (両面表示・マスクのしきい値) ごと、その中はマテリアル順にまとめて
+  // パイプラインとディスクリプタセットの切り替えを減らす.
+  // 半透明はブレンド順を保つため元の順番のまま.
+  m_drawList.resize(m_model.meshes.size());
+  for (uint32_t i = 0; i < uint32_t(m_drawList.size()); ++i)
   {
-    for (const auto& mesh : m_model.meshes)
+    m_drawList[i] = i;
+  }
+  stable_sort(m_drawList.begin(), m_drawList.end(), [&](uint32_t a, uint32_t b) {
+    const auto& meshA = m_model.meshes[a];
+    const auto& meshB = m_model.meshes[b];
+    auto rankA = modeRank(m_model.materials[meshA.materialIndex].alphaMode);
+    auto rankB = modeRank(m_model.materials[meshB.materialIndex].alphaMode);
+    if (rankA != rankB)
     {
-      // 対応するポリゴンメッシュのみを描画する.
-      if (m_model.materials[mesh.materialIndex].alphaMode != mode)
-      {
-        continue;
-      }
+      return rankA < rankB;
+    }
+    if (rankA == 2)
+    {
+      return false;
+    }
+    const auto& materialA = m_model.materials[meshA.materialIndex];
+    const auto& materialB = m_model.materials[meshB.materialIndex];
+    if (materialA.doubleSided != materialB.doubleSided)
+    {
+      return materialA.doubleSided < materialB.doubleSided;
+    }
+    if (rankA == 1 && materialA.alphaCutoff != materialB.alphaCutoff)
+    {
+      return materialA.alphaCutoff < materialB.alphaCutoff;
+    }
+    return meshA.materialIndex < meshB.materialIndex;
+  });
+}
 
-      // モードに応じて使用するパイプラインを変える.
-      switch (mode)
-      {
-      case ALPHA_OPAQUE:
-        vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineOpaque);
-        break;
-      case ALPHA_MASK:
-        vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineOpaque);
-        break;
-      case ALPHA_BLEND:
-        vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineAlpha);
-        break;
-      }
+void ModelApp::recordDraws(VkCommandBuffer command, uint32_t first, uint32_t last)
+{
+  using namespace Microsoft::glTF;
+  if (first >= last)
+  {
+    return;
+  }
 
-      // 各バッファオブジェクトのセット
-      VkDeviceSize offset = 0;
-      vkCmdBindVertexBuffers(command, 0, 1, &mesh.vertexBuffer.buffer, &offset);
-      vkCmdBindIndexBuffer(command, mesh.indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
+  // フレーム単位のディスクリプタセットは全パイプラインで共通のため 1 度だけセット.
+  vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+    0, 1, &m_descriptorSetFrame[m_frameIndex], 0, nullptr);
+  if (m_useBindless)
+  {
+    // 全テクスチャを含むセットなので、以降テクスチャの再バインドは不要.
+    vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+      1, 1, &m_descriptorSetBindless, 0, nullptr);
+  }
 
-      // ディスクリプタセットをセット
-      VkDescriptorSet descriptorSets[] = {
-        mesh.descriptorSet[m_imageIndex]
-      };
-      vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
+  VkPipeline boundPipeline = VK_NULL_HANDLE;
+  int boundMaterial = -1;
+  for (uint32_t i = first; i < last; ++i)
+  {
+    const auto& mesh = m_model.meshes[m_drawList[i]];
+    const auto& material = m_model.materials[mesh.materialIndex];
 
-      // このメッシュを描画
-      vkCmdDrawIndexed(command, mesh.indexCount, 1, 0, 0, 0);
+    // マテリアルに応じて使用するパイプラインを変える.
+    if (material.pipeline != boundPipeline)
+    {
+      vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, material.pipeline);
+      boundPipeline = material.pipeline;
     }
+
+    // 各バッファオブジェクトのセット
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command, 0, 1, &mesh.vertexBuffer.buffer, &offset);
+    vkCmdBindIndexBuffer(command, mesh.indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
+
+    // マテリアルが変わったときのみディスクリプタセットをセット
+    if (!m_useBindless && boundMaterial != mesh.materialIndex)
+    {
+      vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+        1, 1, &material.descriptorSet, 0, nullptr);
+      boundMaterial = mesh.materialIndex;
+    }
+
+    // 描画単位のパラメータはユニフォームバッファを経由せずプッシュ定数で設定.
+    DrawParameters drawParam{};
+    drawParam.mtxWorld = m_model.mtxWorld;
+    drawParam.materialIndex = uint32_t(mesh.materialIndex);
+    vkCmdPushConstants(command, m_pipelineLayout,
+      VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+      0, sizeof(drawParam), &drawParam);
+
+    // このメッシュを描画
+    vkCmdDrawIndexed(command, mesh.indexCount, 1, 0, 0, 0);
+  }
+}
+
+void ModelApp::recordDepthDraws(VkCommandBuffer command)
+{
+  using namespace Microsoft::glTF;
+  vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+    0, 1, &m_descriptorSetFrame[m_frameIndex], 0, nullptr);
+  if (m_useBindless)
+  {
+    vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+      1, 1, &m_descriptorSetBindless, 0, nullptr);
+  }
+
+  // 描画リストは不透明 → マスク → 半透明の順なので、半透明に達したら終わり.
+  VkPipeline boundPipeline = VK_NULL_HANDLE;
+  int boundMaterial = -1;
+  for (auto index : m_drawList)
+  {
+    const auto& mesh = m_model.meshes[index];
+    const auto& material = m_model.materials[mesh.materialIndex];
+    if (material.alphaMode == ALPHA_BLEND)
+    {
+      break;
+    }
+    auto isMask = material.alphaMode == ALPHA_MASK;
+    if (material.depthPipeline != boundPipeline)
+    {
+      vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, material.depthPipeline);
+      boundPipeline = material.depthPipeline;
+    }
+
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command, 0, 1, &mesh.vertexBuffer.buffer, &offset);
+    vkCmdBindIndexBuffer(command, mesh.indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
+
+    // テクスチャを読むのはマスクだけ
+    if (isMask && !m_useBindless && boundMaterial != mesh.materialIndex)
+    {
+      vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout,
+        1, 1, &material.descriptorSet, 0, nullptr);
+      boundMaterial = mesh.materialIndex;
+    }
+
+    DrawParameters drawParam{};
+    drawParam.mtxWorld = m_model.mtxWorld;
+    drawParam.materialIndex = uint32_t(mesh.materialIndex);
+    vkCmdPushConstants(command, m_pipelineLayout,
+      VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+      0, sizeof(drawParam), &drawParam);
+
+    vkCmdDrawIndexed(command, mesh.indexCount, 1, 0, 0, 0);
   }
 }
 
 void ModelApp::makeModelGeometry(const Microsoft::glTF::Document& doc, std::shared_ptr<Microsoft::glTF::GLTFResourceReader> reader )
 {
   using namespace Microsoft::glTF;
+  // リーダーはスレッドセーフではないので、データ列の取得はこのスレッドでまとめて行う.
+  struct MeshSource
+  {
+    std::vector<float> vertPos, vertNrm, vertUV;
+    std::vector<uint32_t> indices;
+    std::vector<Vertex> vertices;
+    size_t vertexCount;
+    int materialIndex;
+  };
+  std::vector<MeshSource> sources;
   for (const auto& mesh : doc.meshes.Elements())
   {
     for (const auto& meshPrimitive : mesh.primitives)
     {
-      std::vector<Vertex> vertices;
-      std::vector<uint32_t> indices;
-
       // 頂点位置情報アクセッサの取得
       auto& idPos = meshPrimitive.GetAttributeAccessorId(ACCESSOR_POSITION);
       auto& accPos = doc.accessors.Get(idPos);
@@ -338,17 +448,33 @@ void ModelApp::makeModelGeometry(const Microsoft::glTF::Document& doc, std::shar
       auto& accIndex = doc.accessors.Get(idIndex);
 
       // アクセッサからデータ列を取得
-      auto vertPos = reader->ReadBinaryData<float>(doc, accPos);
-      auto vertNrm = reader->ReadBinaryData<float>(doc, accNrm);
-      auto vertUV = reader->ReadBinaryData<float>(doc, accUV);
+      MeshSource source;
+      source.vertPos = reader->ReadBinaryData<float>(doc, accPos);
+      source.vertNrm = reader->ReadBinaryData<float>(doc, accNrm);
+      source.vertUV = reader->ReadBinaryData<float>(doc, accUV);
+      // インデックスデータ
+      source.indices = reader->ReadBinaryData<uint32_t>(doc, accIndex);
+      source.vertexCount = accPos.count;
+      source.materialIndex = int(doc.materials.GetIndex(meshPrimitive.materialId));
+      sources.push_back(std::move(source));
+    }
+  }
 
-      auto vertexCount = accPos.count;
-      for (uint32_t i = 0; i < vertexCount; ++i)
+  // 頂点データの構築はメッシュ単位で並列に行う.
+  m_jobSystem.parallelFor(uint32_t(sources.size()), 1, [&sources](uint32_t first, uint32_t last) {
+    for (uint32_t m = first; m < last; ++m)
+    {
+      auto& source = sources[m];
+      const auto& vertPos = source.vertPos;
+      const auto& vertNrm = source.vertNrm;
+      const auto& vertUV = source.vertUV;
+      source.vertices.reserve(source.vertexCount);
+      for (uint32_t i = 0; i < source.vertexCount; ++i)
       {
         // 頂点データの構築
         int vid0 = 3*i, vid1 = 3*i+1, vid2 = 3*i+2;
         int tid0 = 2*i, tid1 = 2*i+1;
-        vertices.emplace_back(
+        source.vertices.emplace_back(
           Vertex{
             vec3(vertPos[vid0], vertPos[vid1],vertPos[vid2]),
             vec3(vertNrm[vid0], vertNrm[vid1],vertNrm[vid2]),
@@ -356,23 +482,29 @@ void ModelApp::makeModelGeometry(const Microsoft::glTF::Document& doc, std::shar
           }
         );
       }
-      // インデックスデータ
-      indices = reader->ReadBinaryData<uint32_t>(doc, accIndex);
-
-      auto vbSize = UINT(sizeof(Vertex)*vertices.size());
-      auto ibSize = UINT(sizeof(uint32_t)*indices.size());
-      ModelMesh modelMesh;
-      modelMesh.vertexBuffer = createBuffer(vbSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, vertices.data());
-      modelMesh.indexBuffer = createBuffer(ibSize,VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, indices.data());
-      modelMesh.vertexCount = UINT(vertices.size());
-      modelMesh.indexCount = UINT(indices.size());
-      modelMesh.materialIndex = int(doc.materials.GetIndex(meshPrimitive.materialId));
-      m_model.meshes.push_back(modelMesh);
     }
+  });
+
+  // バッファの作成と転送はキューを使うのでこのスレッドで行う.
+  for (const auto& source : sources)
+  {
+    const auto& vertices = source.vertices;
+    const auto& indices = source.indices;
+    auto vbSize = UINT(sizeof(Vertex)*vertices.size());
+    auto ibSize = UINT(sizeof(uint32_t)*indices.size());
+    ModelMesh modelMesh;
+    modelMesh.vertexBuffer = createDeviceLocalBuffer(vbSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertices.data());
+    modelMesh.indexBuffer = createDeviceLocalBuffer(ibSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indices.data());
+    modelMesh.vertexCount = UINT(vertices.size());
+    modelMesh.indexCount = UINT(indices.size());
+    modelMesh.materialIndex = source.materialIndex;
+    m_model.meshes.push_back(modelMesh);
   }
 }
 void ModelApp::makeModelMaterial(const Microsoft::glTF::Document& doc, std::shared_ptr<Microsoft::glTF::GLTFResourceReader> reader)
 {
+  // 圧縮された画像データの取得はこのスレッドで行い、デコードだけを並列に行う.
+  std::vector<std::vector<char>> imageDataList;
   for (auto& m : doc.materials.Elements())
   {
     auto textureId = m.metallicRoughness.baseColorTexture.textureId;
@@ -383,19 +515,73 @@ void ModelApp::makeModelMaterial(const Microsoft::glTF::Document& doc, std::shar
     auto& texture = doc.textures.Get(textureId);
     auto& image = doc.images.Get(texture.imageId);
     auto imageBufferView = doc.bufferViews.Get(image.bufferViewId);
-    auto imageData = reader->ReadBinaryData<char>(doc, imageBufferView);
+    imageDataList.push_back(reader->ReadBinaryData<char>(doc, imageBufferView));
+  }
+
+  std::vector<DecodedImage> images(imageDataList.size());
+  m_jobSystem.parallelFor(uint32_t(images.size()), 1, [&](uint32_t first, uint32_t last) {
+    for (uint32_t i = first; i < last; ++i)
+    {
+      images[i] = decodeImage(imageDataList[i]);
+    }
+  });
+
+  // 全テクスチャの転送を 1 つのコマンドにまとめ、レイアウト遷移も前後 1 回ずつのバリアで済ませる.
+  const VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+  std::vector<TextureObject> textures;
+  std::vector<BufferObject> stagingBuffers;
+  for (const auto& image : images)
+  {
+    auto texture = createTexture(uint32_t(image.width), uint32_t(image.height), VK_FORMAT_R8G8B8A8_UNORM);
+    beginImageUpload(texture.image, range);
+    textures.push_back(texture);
 
-    // imageData が画像データ.
+    uint32_t imageSize = image.width * image.height * sizeof(uint32_t);
+    stagingBuffers.push_back(createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, image.pixels));
+    stbi_image_free(image.pixels);
+  }
+
+  auto command = beginUploadCommand();
+  flushUploadBarriers(command);
+  for (size_t i = 0; i < textures.size(); ++i)
+  {
+    VkBufferImageCopy copyRegion{};
+    copyRegion.imageExtent = { uint32_t(images[i].width), uint32_t(images[i].height), 1 };
+    copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    vkCmdCopyBufferToImage(command, stagingBuffers[i].buffer, textures[i].image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+
+    // 転送キューからグラフィックスキューへ渡し、シェーダーから読める状態にする.
+    releaseUploadedImage(textures[i].image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR);
+  }
+  auto uploadValue = submitUploadCommand(command);
+
+  // ステージングバッファは転送の完了後に解放する.
+  deferRelease(m_uploadTimeline, uploadValue, [this, stagingBuffers]() {
+    for (const auto& v : stagingBuffers)
+    {
+      vkFreeMemory(m_device, v.memory, nullptr);
+      vkDestroyBuffer(m_device, v.buffer, nullptr);
+    }
+  });
+
+  uint32_t index = 0;
+  for (auto& m : doc.materials.Elements())
+  {
     Material material{};
     material.alphaMode = m.alphaMode;
-    material.texture = createTextureFromMemory(imageData);
+    material.alphaCutoff = m.alphaCutoff;
+    material.doubleSided = m.doubleSided;
+    material.texture = textures[index];
     m_model.materials.push_back(material);
+    ++index;
   }
 }
 
 void ModelApp::prepareUniformBuffers()
 {
-  m_uniformBuffers.resize(m_swapchainViews.size());
+  // ユニフォームバッファは同時に処理されるフレームの数だけ用意する.
+  m_uniformBuffers.resize(m_frames.size());
   for (auto& v : m_uniformBuffers)
   {
     VkMemoryPropertyFlags uboFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
@@ -404,100 +590,170 @@ void ModelApp::prepareUniformBuffers()
 }
 void ModelApp::prepareDescriptorSetLayout()
 {
-  vector<VkDescriptorSetLayoutBinding> bindings;
-  VkDescriptorSetLayoutBinding bindingUBO{}, bindingTex{};
-  bindingUBO.binding = 0;
-  bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  bindingUBO.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-  bindingUBO.descriptorCount = 1;
-  bindings.push_back(bindingUBO);
-  
-  bindingTex.binding = 1;
-  bindingTex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  bindingTex.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-  bindingTex.descriptorCount = 1;
-  bindings.push_back(bindingTex);
-
-  VkDescriptorSetLayoutCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  ci.bindingCount = uint32_t(bindings.size());
-  ci.pBindings = bindings.data();
-  vkCreateDescriptorSetLayout(m_device, &ci, nullptr, &m_descriptorSetLayout);
+  // フレーム単位: 行列用 UBO
+  {
+    VkDescriptorSetLayoutBinding bindingUBO{};
+    bindingUBO.binding = 0;
+    bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    bindingUBO.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    bindingUBO.descriptorCount = 1;
+
+    VkDescriptorSetLayoutCreateInfo ci{};
+    ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    ci.bindingCount = 1;
+    ci.pBindings = &bindingUBO;
+    vkCreateDescriptorSetLayout(m_device, &ci, nullptr, &m_descriptorSetLayoutFrame);
+  }
+  // マテリアル単位: テクスチャ
+  {
+    VkDescriptorSetLayoutBinding bindingTex{};
+    bindingTex.binding = 0;
+    bindingTex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindingTex.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindingTex.descriptorCount = 1;
+
+    VkDescriptorSetLayoutCreateInfo ci{};
+    ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    ci.bindingCount = 1;
+    ci.pBindings = &bindingTex;
+
+    // bindless: 可変長・部分バインドのテクスチャ配列とする.
+    VkDescriptorBindingFlagsEXT bindingFlags = \
+      VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | \
+      VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsCI{};
+    bindingFlagsCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+    bindingFlagsCI.bindingCount = 1;
+    bindingFlagsCI.pBindingFlags = &bindingFlags;
+    if (m_useBindless)
+    {
+      bindingTex.descriptorCount = getBindlessTextureCapacity();
+      ci.pNext = &bindingFlagsCI;
+    }
+    vkCreateDescriptorSetLayout(m_device, &ci, nullptr, &m_descriptorSetLayoutMaterial);
+  }
 }
 
 void ModelApp::prepareDescriptorPool()
 {
-  const uint32_t count = 100;
-  array<VkDescriptorPoolSize, 2> descPoolSize;
-  descPoolSize[0].descriptorCount = count;
-  descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  descPoolSize[1].descriptorCount = count;
-  descPoolSize[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-
-  uint32_t maxDescriptorCount = uint32_t(m_swapchainImages.size() * m_model.meshes.size());
-  VkDescriptorPoolCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  ci.maxSets = maxDescriptorCount;
-  ci.poolSizeCount = uint32_t(descPoolSize.size());
-  ci.pPoolSizes = descPoolSize.data();
-  vkCreateDescriptorPool(m_device, &ci, nullptr, &m_descriptorPool);
+  // 必要数ぴったりではなく目安のサイズで用意し、足りなければアロケータがプールを追加する.
+  // テクスチャはマテリアルセット 1 つにつき 1 つ (bindless 時は 1 セットに全テクスチャ).
+  const auto frameCount = uint32_t(m_uniformBuffers.size());
+  const auto materialCount = uint32_t(m_model.materials.size());
+  const auto setCount = frameCount + (m_useBindless ? 1 : materialCount);
+  const auto textureRatio = float(materialCount) / float(setCount);
+  m_descriptorAllocator.initialize(m_device, setCount,
+    {
+      { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1.0f },
+      { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, (std::max)(textureRatio, 1.0f) },
+    });
 }
 
 void ModelApp::prepareDescriptorSet()
 {
-  vector<VkDescriptorSetLayout> layouts;
-  for (int i = 0; i<int(m_uniformBuffers.size()); ++i)
+  // ディスクリプタセットの確保 (フレーム用・マテリアル用それぞれまとめて)
+  vector<VkDescriptorSetLayout> layouts(m_uniformBuffers.size(), m_descriptorSetLayoutFrame);
+  m_descriptorSetFrame.resize(layouts.size());
+  auto result = m_descriptorAllocator.allocate(uint32_t(layouts.size()), layouts.data(), m_descriptorSetFrame.data());
+  checkResult(result);
+
+  vector<VkDescriptorSet> materialSets(m_model.materials.size());
+  if (m_useBindless)
+  {
+    // 配列の長さはマテリアル数に合わせる.
+    uint32_t variableCount = uint32_t(m_model.materials.size());
+    VkDescriptorSetVariableDescriptorCountAllocateInfoEXT variableCountAI{};
+    variableCountAI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO_EXT;
+    variableCountAI.descriptorSetCount = 1;
+    variableCountAI.pDescriptorCounts = &variableCount;
+
+    result = m_descriptorAllocator.allocate(m_descriptorSetLayoutMaterial, &m_descriptorSetBindless, &variableCountAI);
+    checkResult(result);
+  }
+  else
   {
-    layouts.push_back(m_descriptorSetLayout);
+    layouts.assign(materialSets.size(), m_descriptorSetLayoutMaterial);
+    result = m_descriptorAllocator.allocate(uint32_t(layouts.size()), layouts.data(), materialSets.data());
+    checkResult(result);
   }
 
-  for (auto& mesh : m_model.meshes)
+  // 書き込み内容を集めて 1 回の vkUpdateDescriptorSets で更新する.
+  // (pBufferInfo/pImageInfo が指す先が動かないよう先に領域を確保しておく)
+  vector<VkDescriptorBufferInfo> bufferInfos(m_uniformBuffers.size());
+  vector<VkDescriptorImageInfo> imageInfos(m_model.materials.size());
+  vector<VkWriteDescriptorSet> writeSets;
+  writeSets.reserve(bufferInfos.size() + imageInfos.size());
+
+  for (size_t i = 0; i < m_uniformBuffers.size(); ++i)
   {
-    // ディスクリプタセットの確保
-    VkDescriptorSetAllocateInfo ai{};
-    ai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    ai.descriptorPool = m_descriptorPool;
-    ai.descriptorSetCount = uint32_t(m_uniformBuffers.size());
-    ai.pSetLayouts = layouts.data();
-    mesh.descriptorSet.resize(m_uniformBuffers.size());
-    vkAllocateDescriptorSets(m_device, &ai, mesh.descriptorSet.data());
-
-    // ディスクリプタセットへ書き込み.
-    auto material = m_model.materials[mesh.materialIndex];
-    for (int i = 0; i<int(m_uniformBuffers.size()); ++i)
+    auto& descUBO = bufferInfos[i];
+    descUBO.buffer = m_uniformBuffers[i].buffer;
+    descUBO.offset = 0;
+    descUBO.range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet ubo{};
+    ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    ubo.dstBinding = 0;
+    ubo.descriptorCount = 1;
+    ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    ubo.pBufferInfo = &descUBO;
+    ubo.dstSet = m_descriptorSetFrame[i];
+    writeSets.push_back(ubo);
+  }
+  for (size_t i = 0; i < m_model.materials.size(); ++i)
+  {
+    auto& material = m_model.materials[i];
+    material.descriptorSet = materialSets[i];
+
+    auto& descImage = imageInfos[i];
+    descImage.imageView = material.texture.view;
+    descImage.sampler = m_sampler;
+    descImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    if (m_useBindless)
     {
-      VkDescriptorBufferInfo descUBO{};
-      descUBO.buffer = m_uniformBuffers[i].buffer;
-      descUBO.offset = 0;
-      descUBO.range = VK_WHOLE_SIZE;
-
-      VkDescriptorImageInfo  descImage{};
-      descImage.imageView = material.texture.view;
-      descImage.sampler = m_sampler;
-      descImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-      VkWriteDescriptorSet ubo{};
-      ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-      ubo.dstBinding = 0;
-      ubo.descriptorCount = 1;
-      ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-      ubo.pBufferInfo = &descUBO;
-      ubo.dstSet = mesh.descriptorSet[i];
-
-      VkWriteDescriptorSet tex{};
-      tex.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-      tex.dstBinding = 1;
-      tex.descriptorCount = 1;
-      tex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-      tex.pImageInfo = &descImage;
-      tex.dstSet = mesh.descriptorSet[i];
-
-      vector<VkWriteDescriptorSet> writeSets = {
-        ubo, tex
-      };
-      vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
+      continue;
     }
+
+    VkWriteDescriptorSet tex{};
+    tex.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    tex.dstBinding = 0;
+    tex.descriptorCount = 1;
+    tex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    tex.pImageInfo = &descImage;
+    tex.dstSet = material.descriptorSet;
+    writeSets.push_back(tex);
   }
+  if (m_useBindless && !imageInfos.empty())
+  {
+    // 配列の要素 = マテリアル番号 として一括で書き込む.
+    VkWriteDescriptorSet tex{};
+    tex.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    tex.dstBinding = 0;
+    tex.dstArrayElement = 0;
+    tex.descriptorCount = uint32_t(imageInfos.size());
+    tex.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    tex.pImageInfo = imageInfos.data();
+    tex.dstSet = m_descriptorSetBindless;
+    writeSets.push_back(tex);
+  }
+  vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
+
+  m_descriptorAllocator.report("ModelApp");
+}
+
+uint32_t ModelApp::getBindlessTextureCapacity() const
+{
+  // レイアウト上の配列サイズ (実際に確保するのはマテリアル数分のみ)
+  // 結合イメージサンプラーはサンプラーとサンプルイメージの両方の上限に数えられる.
+  const auto& limits = m_physDevProps.limits;
+  uint32_t capacity = 1024;
+  capacity = (std::min)(capacity, limits.maxPerStageDescriptorSamplers);
+  capacity = (std::min)(capacity, limits.maxPerStageDescriptorSampledImages);
+  capacity = (std::min)(capacity, limits.maxDescriptorSetSamplers);
+  capacity = (std::min)(capacity, limits.maxDescriptorSetSampledImages);
+  // フラグメントステージではカラーアタッチメント (1 つ) もリソース数に含まれる.
+  capacity = (std::min)(capacity, limits.maxPerStageResources - 1);
+  return capacity;
 }
 
 ModelApp::BufferObject ModelApp::createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, const void* initialData)
@@ -535,31 +791,31 @@ ModelApp::BufferObject ModelApp::createBuffer(uint32_t size, VkBufferUsageFlags
   return obj;
 }
 
-VkPipelineShaderStageCreateInfo ModelApp::loadShaderModule(const char* fileName, VkShaderStageFlagBits stage)
+ModelApp::BufferObject ModelApp::createDeviceLocalBuffer(uint32_t size, VkBufferUsageFlags usage, const void* initialData)
 {
-  ifstream infile(fileName, std::ios::binary);
-  if (!infile)
-  {
-    OutputDebugStringA("file not found.\n");
-    DebugBreak();
-  }
-  vector<char> filedata;
-  filedata.resize(uint32_t(infile.seekg(0, ifstream::end).tellg()));
-  infile.seekg(0, ifstream::beg).read(filedata.data(), filedata.size());
-
-  VkShaderModule shaderModule;
-  VkShaderModuleCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  ci.pCode = reinterpret_cast<uint32_t*>(filedata.data());
-  ci.codeSize = filedata.size();
-  vkCreateShaderModule(m_device, &ci, nullptr, &shaderModule);
-
-  VkPipelineShaderStageCreateInfo shaderStageCI{};
-  shaderStageCI.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shaderStageCI.stage = stage;
-  shaderStageCI.module = shaderModule;
-  shaderStageCI.pName = "main";
-  return shaderStageCI;
+  // ステージングバッファ経由で転送キューからコピーする.
+  auto stagingBuffer = createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, initialData);
+  auto obj = createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nullptr);
+
+  auto command = beginUploadCommand();
+  VkBufferCopy region{};
+  region.size = size;
+  vkCmdCopyBuffer(command, stagingBuffer.buffer, obj.buffer, 1, &region);
+  if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+  {
+    releaseUploadedBuffer(obj.buffer, VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT_KHR, VK_ACCESS_2_INDEX_READ_BIT_KHR);
+  }
+  else
+  {
+    releaseUploadedBuffer(obj.buffer, VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR, VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT_KHR);
+  }
+  auto uploadValue = submitUploadCommand(command);
+
+  deferRelease(m_uploadTimeline, uploadValue, [this, stagingBuffer]() {
+    vkFreeMemory(m_device, stagingBuffer.memory, nullptr);
+    vkDestroyBuffer(m_device, stagingBuffer.buffer, nullptr);
+  });
+  return obj;
 }
 
 VkSampler ModelApp::createSampler()
@@ -577,23 +833,26 @@ VkSampler ModelApp::createSampler()
   return sampler;
 }
 
-ModelApp::TextureObject ModelApp::createTextureFromMemory(const std::vector<char>& imageData)
+ModelApp::DecodedImage ModelApp::decodeImage(const std::vector<char>& imageData)
 {
-  BufferObject stagingBuffer;
-  TextureObject texture{};
-  int width, height, channels;
-  auto* pImage = stbi_load_from_memory(
+  // Vulkan を使わないので、ワーカースレッドから呼んでよい.
+  DecodedImage image{};
+  int channels;
+  image.pixels = stbi_load_from_memory(
     reinterpret_cast<const uint8_t*>(imageData.data()),
     int(imageData.size()),
-    &width, &height, &channels, 0);
-
-  auto format = VK_FORMAT_R8G8B8A8_UNORM;
+    &image.width, &image.height, &channels, 0);
+  return image;
+}
 
+ModelApp::TextureObject ModelApp::createTexture(uint32_t width, uint32_t height, VkFormat format)
+{
+  TextureObject texture{};
   {
     // テクスチャのVkImage を生成
     VkImageCreateInfo ci{};
     ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    ci.extent = { uint32_t(width), uint32_t(height), 1 };
+    ci.extent = { width, height, 1 };
     ci.format = format;
     ci.imageType = VK_IMAGE_TYPE_2D;
     ci.arrayLayers = 1;
@@ -615,40 +874,6 @@ ModelApp::TextureObject ModelApp::createTextureFromMemory(const std::vector<char
     // メモリのバインド
     vkBindImageMemory(m_device, texture.image, texture.memory, 0);
   }
-
-  {
-    uint32_t imageSize = width * height * sizeof(uint32_t);
-    // ステージングバッファを用意.
-    stagingBuffer = createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, pImage);
-  }
-
-  VkBufferImageCopy copyRegion{};
-  copyRegion.imageExtent = { uint32_t(width), uint32_t(height), 1 };
-  copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-  VkCommandBuffer command;
-  {
-    VkCommandBufferAllocateInfo ai{};
-    ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    ai.commandBufferCount = 1;
-    ai.commandPool = m_commandPool;
-    ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkAllocateCommandBuffers(m_device, &ai, &command);
-  }
-
-  VkCommandBufferBeginInfo commandBI{};
-  commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  vkBeginCommandBuffer(command, &commandBI);
-  setImageMemoryBarrier(command, texture.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-  vkCmdCopyBufferToImage(command, stagingBuffer.buffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-  setImageMemoryBarrier(command, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-  vkEndCommandBuffer(command);
-
-  VkSubmitInfo submitInfo{};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &command;
-  vkQueueSubmit(m_deviceQueue, 1, &submitInfo, VK_NULL_HANDLE);
   {
     // テクスチャ参照用のビューを生成
     VkImageViewCreateInfo ci{};
@@ -667,73 +892,6 @@ ModelApp::TextureObject ModelApp::createTextureFromMemory(const std::vector<char
     };
     vkCreateImageView(m_device, &ci, nullptr, &texture.view);
   }
-
-  vkDeviceWaitIdle(m_device);
-  vkFreeCommandBuffers(m_device, m_commandPool, 1, &command);
-
-  // ステージングバッファ解放.
-  vkFreeMemory(m_device, stagingBuffer.memory, nullptr);
-  vkDestroyBuffer(m_device, stagingBuffer.buffer, nullptr);
-
   return texture;
 }
 
-void ModelApp::setImageMemoryBarrier(
-  VkCommandBuffer command,
-  VkImage image,
-  VkImageLayout oldLayout, VkImageLayout newLayout)
-{
-  VkImageMemoryBarrier imb{};
-  imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  imb.oldLayout = oldLayout;
-  imb.newLayout = newLayout;
-  imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  imb.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-  imb.image = image;
-
-  VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-  VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-
-  switch (oldLayout)
-  {
-  case VK_IMAGE_LAYOUT_UNDEFINED:
-    imb.srcAccessMask = 0;
-    break;
-  case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-    imb.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    break;
-  }
-
-  switch (newLayout)
-  {
-  case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
-    imb.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    break;
-  case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
-    imb.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    break;
-  case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
-    imb.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    break;
-  }
-
-  //srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;  // パイプライン中でリソースへの書込み最終のステージ.
-  //dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;  // パイプライン中で次にリソースに書き込むステージ.
-
-  vkCmdPipelineBarrier(
-    command,
-    srcStage,
-    dstStage,
-    0,
-    0,  // memoryBarrierCount
-    nullptr,
-    0,  // bufferMemoryBarrierCount
-    nullptr,
-    1,  // imageMemoryBarrierCount
-    &imb);
-}
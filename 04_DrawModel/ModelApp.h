@@ -1,6 +1,7 @@
-#pragma once
+﻿#pragma once
 
 #include "../common/vkappbase.h"
+#include "../common/descriptorallocator.h"
 #include "glm/glm.hpp"
 #include "GLTFSDK/GLTF.h"
 
@@ -16,12 +17,18 @@ namespace Microsoft
 class ModelApp : public VulkanAppBase
 {
 public:
-  ModelApp() : VulkanAppBase() { }
+  ModelApp() : VulkanAppBase(), m_depthPrepass(false) { }
+
+  // 深度プリパス (initialize 前に設定する. コマンドラインでは --depth-prepass).
+  // 不透明・マスクの形状の深度だけを先に描き、メインパスは EQUAL で一致したフラグメントだけをシェーディングする.
+  void setDepthPrepass(bool enable) { m_depthPrepass = enable; }
 
   virtual void prepare() override;
   virtual void cleanup() override;
 
   virtual void makeCommand(VkCommandBuffer command) override;
+  virtual void makeCommandSecondary(VkCommandBuffer command, uint32_t workerIndex, uint32_t workerCount) override;
+  virtual void onBeginFrame() override;
 
   struct Vertex
   {
@@ -30,6 +37,10 @@ public:
     glm::vec2 uv;
   };
 private:
+  virtual void declareRequirements(Requirements& req) override;
+  virtual bool parseOption(const std::wstring& key, const std::wstring& value) override;
+  virtual void buildRenderGraph(RenderGraph& graph, RenderGraph::Handle backBuffer, RenderGraph::Handle depthBuffer) override;
+
   struct BufferObject
   {
     VkBuffer buffer;
@@ -41,11 +52,16 @@ private:
     VkDeviceMemory memory;
     VkImageView view;
   };
+  // フレーム単位のパラメータ (ユニフォームバッファ)
   struct ShaderParameters
+  {
+    glm::mat4 mtxViewProj;  // proj * view を CPU 側で合成済みのもの
+  };
+  // 描画単位のパラメータ (プッシュ定数)
+  struct DrawParameters
   {
     glm::mat4 mtxWorld;
-    glm::mat4 mtxView;
-    glm::mat4 mtxProj;
+    uint32_t  materialIndex;
   };
 
   struct ModelMesh
@@ -56,44 +72,79 @@ private:
     uint32_t indexCount;
 
     int materialIndex;
-
-    std::vector<VkDescriptorSet> descriptorSet;
   };
   struct Material
   {
     TextureObject texture;
     Microsoft::glTF::AlphaMode alphaMode;
+    float alphaCutoff;    // ALPHA_MASK で破棄するアルファのしきい値
+    bool doubleSided;     // 両面表示 (裏面をカリングしない)
+
+    VkPipeline pipeline;        // m_pipelineCache が所有する
+    VkPipeline depthPipeline;   // 深度プリパス用 (使わない場合は VK_NULL_HANDLE)
+
+    VkDescriptorSet descriptorSet;
   };
   struct Model
   {
     std::vector<ModelMesh> meshes;
     std::vector<Material> materials;
+    glm::mat4 mtxWorld;
   };
   
   void makeModelGeometry(const Microsoft::glTF::Document&, std::shared_ptr<Microsoft::glTF::GLTFResourceReader> reader);
   void makeModelMaterial(const Microsoft::glTF::Document&, std::shared_ptr<Microsoft::glTF::GLTFResourceReader> reader);
 
+  // パイプラインを決める要素
+  struct PipelineKey
+  {
+    Microsoft::glTF::AlphaMode alphaMode;
+    float alphaCutoff;    // ALPHA_MASK のみ. しきい値はシェーダーに特殊化する.
+    bool doubleSided;
+    bool depthOnly;       // 深度プリパス用
+  };
+  PipelineDesc makePipelineDesc(const PipelineKey& key);
+
+  void prepareDrawList();
+  void recordDraws(VkCommandBuffer command, uint32_t first, uint32_t last);
+  void recordDepthDraws(VkCommandBuffer command);
+
   void prepareUniformBuffers();
   void prepareDescriptorSetLayout();
   void prepareDescriptorPool();
   void prepareDescriptorSet();
+  uint32_t getBindlessTextureCapacity() const;
 
   BufferObject createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, const void* initialData);
-  VkPipelineShaderStageCreateInfo loadShaderModule(const char* fileName, VkShaderStageFlagBits stage);
+  BufferObject createDeviceLocalBuffer(uint32_t size, VkBufferUsageFlags usage, const void* initialData);
   VkSampler createSampler();
-  TextureObject createTextureFromMemory(const std::vector<char>& imageData);
-  void setImageMemoryBarrier( VkCommandBuffer command, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
+  // デコード済みの画像 (stbi_image_free で解放する)
+  struct DecodedImage
+  {
+    uint8_t* pixels;
+    int width, height;
+  };
+  DecodedImage decodeImage(const std::vector<char>& imageData);
+  TextureObject createTexture(uint32_t width, uint32_t height, VkFormat format);
 
   Model m_model;
+  // 描画順に並べたメッシュ番号. スレッドごとにこの連続した範囲を記録する.
+  std::vector<uint32_t> m_drawList;
 
   std::vector<BufferObject> m_uniformBuffers;
 
-  VkDescriptorSetLayout m_descriptorSetLayout;
-  VkDescriptorPool  m_descriptorPool;
+  // set=0: フレーム単位 (UBO), set=1: マテリアル単位 (テクスチャ)
+  VkDescriptorSetLayout m_descriptorSetLayoutFrame;
+  VkDescriptorSetLayout m_descriptorSetLayoutMaterial;
+  DescriptorAllocator m_descriptorAllocator;
+  std::vector<VkDescriptorSet> m_descriptorSetFrame;
+
+  // bindless 使用時は set=1 に全マテリアルのテクスチャを配列で持つ.
+  bool m_useBindless;
+  VkDescriptorSet m_descriptorSetBindless;
 
   VkSampler m_sampler;
 
   VkPipelineLayout m_pipelineLayout;
-  VkPipeline  m_pipelineOpaque;
-  VkPipeline  m_pipelineAlpha;
+  bool        m_depthPrepass;
 };
\ No newline at end of file
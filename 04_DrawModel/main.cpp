@@ -17,14 +17,14 @@ const char* AppTitle = "DrawModel";
 int __stdcall wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
 {
   UNREFERENCED_PARAMETER(hPrevInstance);
-  UNREFERENCED_PARAMETER(lpCmdLine);
   glfwInit();
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-  glfwWindowHint(GLFW_RESIZABLE, 0);
+  glfwWindowHint(GLFW_RESIZABLE, 1);
   auto window = glfwCreateWindow(WindowWidth, WindowHeight, AppTitle, nullptr, nullptr);
 
   // Vulkan 初期化
   ModelApp theApp;
+  theApp.applyCommandLine(lpCmdLine);
   theApp.initialize(window, AppTitle);
 
   while (glfwWindowShouldClose(window) == GLFW_FALSE)
@@ -5,21 +5,25 @@ layout(location=1) in vec3 inNormal;
 layout(location=2) in vec2 inUV;
 layout(location=0) out vec2 outUV;
 
-layout(binding=0) uniform Matrices
+layout(set=0, binding=0) uniform Matrices
+{
+  mat4 viewProj;
+};
+
+layout(push_constant) uniform DrawParameters
 {
   mat4 world;
-  mat4 view;
-  mat4 proj;
+  uint materialIndex;
 };
 
 out gl_PerVertex
 {
   vec4 gl_Position;
 };
+invariant gl_Position;
 
 void main()
 {
-  mat4 pvw = proj * view * world;
-  gl_Position = pvw * vec4(inPos, 1.0);
+  gl_Position = viewProj * (world * vec4(inPos, 1.0));
   outUV = inUV;
 }
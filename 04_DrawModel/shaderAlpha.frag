@@ -3,7 +3,7 @@
 layout(location=0) in vec2 inUV;
 layout(location=0) out vec4 outColor;
 
-layout(binding=1) uniform sampler2D diffuseMap;
+layout(set=1, binding=0) uniform sampler2D diffuseMap;
 
 void main()
 {
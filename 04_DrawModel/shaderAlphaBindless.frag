@@ -0,0 +1,18 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(location=0) in vec2 inUV;
+layout(location=0) out vec4 outColor;
+
+layout(set=1, binding=0) uniform sampler2D diffuseMaps[];
+
+layout(push_constant) uniform DrawParameters
+{
+  layout(offset=64) uint materialIndex;
+};
+
+void main()
+{
+  vec4 color = texture(diffuseMaps[materialIndex], inUV);
+  outColor = color;
+}
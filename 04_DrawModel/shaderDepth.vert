@@ -0,0 +1,26 @@
+#version 450
+
+layout(location=0) in vec3 inPos;
+
+layout(set=0, binding=0) uniform Matrices
+{
+  mat4 viewProj;
+};
+
+layout(push_constant) uniform DrawParameters
+{
+  mat4 world;
+  uint materialIndex;
+};
+
+out gl_PerVertex
+{
+  vec4 gl_Position;
+};
+// メインパスと EQUAL で比較するため、shader.vert と同じ式・同じ精度で計算させる.
+invariant gl_Position;
+
+void main()
+{
+  gl_Position = viewProj * (world * vec4(inPos, 1.0));
+}
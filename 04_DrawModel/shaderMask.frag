@@ -0,0 +1,19 @@
+#version 450
+
+layout(location=0) in vec2 inUV;
+layout(location=0) out vec4 outColor;
+
+layout(set=1, binding=0) uniform sampler2D diffuseMap;
+
+// マテリアルの alphaCutoff. パイプラインの作成時に特殊化する.
+layout(constant_id=0) const float alphaCutoff = 0.5;
+
+void main()
+{
+  vec4 color = texture(diffuseMap, inUV);
+  if( color.a < alphaCutoff )
+  {
+    discard;
+  }
+  outColor = color;
+}
@@ -0,0 +1,25 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(location=0) in vec2 inUV;
+layout(location=0) out vec4 outColor;
+
+layout(set=1, binding=0) uniform sampler2D diffuseMaps[];
+
+layout(push_constant) uniform DrawParameters
+{
+  layout(offset=64) uint materialIndex;
+};
+
+// マテリアルの alphaCutoff. パイプラインの作成時に特殊化する.
+layout(constant_id=0) const float alphaCutoff = 0.5;
+
+void main()
+{
+  vec4 color = texture(diffuseMaps[materialIndex], inUV);
+  if( color.a < alphaCutoff )
+  {
+    discard;
+  }
+  outColor = color;
+}
@@ -0,0 +1,138 @@
+﻿#include "descriptorallocator.h"
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+  // 1 つのプールで確保できるセット数の上限
+  const uint32_t MaxSetsPerPool = 4096;
+}
+
+DescriptorAllocator::DescriptorAllocator()
+  : m_device(VK_NULL_HANDLE)
+  , m_currentPool(0)
+  , m_nextPoolSets(0)
+  , m_exhaustCount(0)
+{
+}
+
+void DescriptorAllocator::initialize(VkDevice device, uint32_t initialSets, const std::vector<PoolSizeRatio>& ratios)
+{
+  m_device = device;
+  m_ratios = ratios;
+  m_nextPoolSets = (std::min)((std::max)(initialSets, 1u), MaxSetsPerPool);
+  m_currentPool = 0;
+  m_exhaustCount = 0;
+}
+
+void DescriptorAllocator::terminate()
+{
+  for (auto& v : m_pools)
+  {
+    vkDestroyDescriptorPool(m_device, v.pool, nullptr);
+  }
+  m_pools.clear();
+  m_currentPool = 0;
+}
+
+VkResult DescriptorAllocator::allocate(uint32_t count, const VkDescriptorSetLayout* layouts, VkDescriptorSet* sets, const void* pNext)
+{
+  VkDescriptorSetAllocateInfo ai{};
+  ai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  ai.pNext = pNext;
+  ai.descriptorSetCount = count;
+  ai.pSetLayouts = layouts;
+
+  for (;;)
+  {
+    if (m_currentPool == m_pools.size())
+    {
+      // 使えるプールがないので追加する. 次のプールは 2 倍の大きさにする.
+      m_pools.push_back(createPool(m_nextPoolSets));
+      m_nextPoolSets = (std::min)(m_nextPoolSets * 2, MaxSetsPerPool);
+    }
+    auto& pool = m_pools[m_currentPool];
+    ai.descriptorPool = pool.pool;
+    auto result = vkAllocateDescriptorSets(m_device, &ai, sets);
+    if (result == VK_SUCCESS)
+    {
+      pool.allocatedSets += count;
+      return result;
+    }
+    if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL)
+    {
+      return result;
+    }
+    if (pool.allocatedSets == 0 && pool.maxSets == MaxSetsPerPool)
+    {
+      // 最大サイズの空プールでも確保できない要求.
+      return result;
+    }
+    // このプールは使い切ったので次のプールへ.
+    ++m_exhaustCount;
+    ++m_currentPool;
+  }
+}
+
+VkResult DescriptorAllocator::allocate(VkDescriptorSetLayout layout, VkDescriptorSet* set, const void* pNext)
+{
+  return allocate(1, &layout, set, pNext);
+}
+
+void DescriptorAllocator::reset()
+{
+  // プール自体は破棄せずに再利用する.
+  for (auto& v : m_pools)
+  {
+    vkResetDescriptorPool(m_device, v.pool, 0);
+    v.allocatedSets = 0;
+  }
+  m_currentPool = 0;
+}
+
+void DescriptorAllocator::report(const char* name) const
+{
+  uint32_t capacity = 0, allocated = 0;
+  for (const auto& v : m_pools)
+  {
+    capacity += v.maxSets;
+    allocated += v.allocatedSets;
+  }
+  std::stringstream ss;
+  ss << "[" << name << "] descriptor pools: " << m_pools.size()
+    << ", sets: " << allocated << " / " << capacity;
+  if (capacity > 0)
+  {
+    ss << " (" << (allocated * 100 / capacity) << "%)";
+  }
+  ss << ", pool exhausted: " << m_exhaustCount << std::endl;
+  OutputDebugStringA(ss.str().c_str());
+}
+
+DescriptorAllocator::Pool DescriptorAllocator::createPool(uint32_t maxSets)
+{
+  vector<VkDescriptorPoolSize> poolSizes;
+  for (const auto& v : m_ratios)
+  {
+    VkDescriptorPoolSize size{};
+    size.type = v.type;
+    size.descriptorCount = (std::max)(uint32_t(v.ratio * maxSets), 1u);
+    poolSizes.push_back(size);
+  }
+
+  Pool pool{};
+  pool.maxSets = maxSets;
+  VkDescriptorPoolCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  ci.maxSets = maxSets;
+  ci.poolSizeCount = uint32_t(poolSizes.size());
+  ci.pPoolSizes = poolSizes.data();
+  auto result = vkCreateDescriptorPool(m_device, &ci, nullptr, &pool.pool);
+  if (result != VK_SUCCESS)
+  {
+    DebugBreak();
+  }
+  return pool;
+}
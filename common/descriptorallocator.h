@@ -0,0 +1,48 @@
+﻿#pragma once
+#include "vkappbase.h"
+#include <vector>
+
+// ディスクリプタセットのアロケータ.
+// プールの容量が足りなくなったら (VK_ERROR_OUT_OF_POOL_MEMORY) 新しいプールを追加して確保しなおす.
+// 追加されるプールは 1 つ前のプールの 2 倍の大きさになる.
+class DescriptorAllocator
+{
+public:
+  // 1 セットあたりに用意しておくディスクリプタ数の比率
+  struct PoolSizeRatio
+  {
+    VkDescriptorType type;
+    float ratio;
+  };
+
+  DescriptorAllocator();
+
+  void initialize(VkDevice device, uint32_t initialSets, const std::vector<PoolSizeRatio>& ratios);
+  void terminate();
+
+  // pNext には VkDescriptorSetVariableDescriptorCountAllocateInfo などを指定できる.
+  VkResult allocate(uint32_t count, const VkDescriptorSetLayout* layouts, VkDescriptorSet* sets, const void* pNext = nullptr);
+  VkResult allocate(VkDescriptorSetLayout layout, VkDescriptorSet* set, const void* pNext = nullptr);
+
+  // 全プールをまとめてリセットする. 確保済みのセットはすべて無効になる.
+  void reset();
+
+  // プールの使用状況をデバッグ出力へ表示する.
+  void report(const char* name) const;
+
+private:
+  struct Pool
+  {
+    VkDescriptorPool pool;
+    uint32_t maxSets;
+    uint32_t allocatedSets;
+  };
+  Pool createPool(uint32_t maxSets);
+
+  VkDevice  m_device;
+  std::vector<PoolSizeRatio> m_ratios;
+  std::vector<Pool> m_pools;
+  uint32_t  m_currentPool;    // 現在確保に使っているプールの番号
+  uint32_t  m_nextPoolSets;
+  uint32_t  m_exhaustCount;   // プール不足で次のプールへ移った回数
+};
@@ -0,0 +1,180 @@
+﻿#include "jobsystem.h"
+#include <algorithm>
+
+using namespace std;
+
+static thread_local uint32_t s_threadIndex = 0;
+
+JobSystem::JobSystem()
+  : m_pending(0), m_running(false)
+{
+}
+
+JobSystem::~JobSystem()
+{
+  terminate();
+}
+
+void JobSystem::initialize(uint32_t workerCount)
+{
+  if (workerCount == 0)
+  {
+    auto cores = thread::hardware_concurrency();
+    workerCount = cores > 1 ? cores - 1 : 1;
+  }
+  s_threadIndex = 0;
+  m_queues.resize(workerCount + 1);
+  for (auto& v : m_queues)
+  {
+    v = make_unique<Queue>();
+  }
+  m_running = true;
+  for (uint32_t i = 1; i <= workerCount; ++i)
+  {
+    m_threads.emplace_back(&JobSystem::workerMain, this, i);
+  }
+}
+
+void JobSystem::terminate()
+{
+  if (!m_running)
+  {
+    return;
+  }
+  {
+    lock_guard<mutex> lock(m_sleepMutex);
+    m_running = false;
+  }
+  m_sleepCond.notify_all();
+  for (auto& v : m_threads)
+  {
+    v.join();
+  }
+  m_threads.clear();
+  m_queues.clear();
+}
+
+uint32_t JobSystem::getThreadIndex()
+{
+  return s_threadIndex;
+}
+
+void JobSystem::run(Job job, Counter* counter)
+{
+  if (m_queues.empty())
+  {
+    job();
+    return;
+  }
+  if (counter)
+  {
+    counter->m_value.fetch_add(1, memory_order_relaxed);
+  }
+  auto& queue = *m_queues[getThreadIndex()];
+  {
+    lock_guard<mutex> lock(queue.mutex);
+    queue.tasks.push_back(Task{ move(job), counter });
+  }
+  m_pending.fetch_add(1, memory_order_release);
+  {
+    // 眠りに入る直前のワーカーが通知を取りこぼさないよう、ロックを経由してから通知する.
+    lock_guard<mutex> lock(m_sleepMutex);
+  }
+  m_sleepCond.notify_one();
+}
+
+void JobSystem::wait(Counter& counter)
+{
+  auto index = getThreadIndex();
+  while (!counter.isDone())
+  {
+    if (m_queues.empty() || !tryExecute(index))
+    {
+      this_thread::yield();
+    }
+  }
+}
+
+void JobSystem::parallelFor(uint32_t count, uint32_t grain, const function<void(uint32_t, uint32_t)>& func)
+{
+  if (count == 0)
+  {
+    return;
+  }
+  if (grain == 0)
+  {
+    // スレッド数の 4 倍程度に分けて、ばらつきをスティールでならす.
+    grain = (max)(1u, count / ((max)(1u, getThreadCount()) * 4));
+  }
+  Counter counter;
+  for (uint32_t first = 0; first < count; first += grain)
+  {
+    auto last = (min)(count, first + grain);
+    run([&func, first, last]() { func(first, last); }, &counter);
+  }
+  wait(counter);
+}
+
+bool JobSystem::pop(uint32_t index, Task& task)
+{
+  // 自分のキューは末尾から取り出す. 直前に積んだジョブの方がキャッシュに残っている.
+  auto& queue = *m_queues[index];
+  lock_guard<mutex> lock(queue.mutex);
+  if (queue.tasks.empty())
+  {
+    return false;
+  }
+  task = move(queue.tasks.back());
+  queue.tasks.pop_back();
+  return true;
+}
+
+bool JobSystem::steal(uint32_t index, Task& task)
+{
+  // 他のスレッドのキューは先頭 (古いジョブ) から取り出す.
+  auto count = uint32_t(m_queues.size());
+  for (uint32_t i = 1; i < count; ++i)
+  {
+    auto& queue = *m_queues[(index + i) % count];
+    lock_guard<mutex> lock(queue.mutex);
+    if (!queue.tasks.empty())
+    {
+      task = move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool JobSystem::tryExecute(uint32_t index)
+{
+  Task task;
+  if (!pop(index, task) && !steal(index, task))
+  {
+    return false;
+  }
+  m_pending.fetch_sub(1, memory_order_relaxed);
+  task.job();
+  if (task.counter)
+  {
+    task.counter->m_value.fetch_sub(1, memory_order_release);
+  }
+  return true;
+}
+
+void JobSystem::workerMain(uint32_t index)
+{
+  s_threadIndex = index;
+  while (m_running)
+  {
+    if (tryExecute(index))
+    {
+      continue;
+    }
+    unique_lock<mutex> lock(m_sleepMutex);
+    m_sleepCond.wait(lock, [this]() {
+      return !m_running || m_pending.load(memory_order_acquire) > 0;
+    });
+  }
+}
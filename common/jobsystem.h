@@ -0,0 +1,73 @@
+﻿#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ワークスティーリング方式のジョブシステム.
+// スレッドごとにジョブのキューを持ち、自分のキューは末尾から、他のスレッドのキューは先頭から取り出す.
+// メインスレッド (initialize を呼んだスレッド) は番号 0 として、wait の間ジョブの実行に参加する.
+class JobSystem
+{
+public:
+  // 完了待ち用のカウンタ. ジョブの登録で増え、ジョブの終了で減る.
+  // ジョブの中から同じカウンタで子ジョブを登録すると、wait は子ジョブの完了まで待つ.
+  class Counter
+  {
+  public:
+    Counter() : m_value(0) { }
+    bool isDone() const { return m_value.load(std::memory_order_acquire) == 0; }
+  private:
+    friend class JobSystem;
+    std::atomic<uint32_t> m_value;
+  };
+  using Job = std::function<void()>;
+
+  JobSystem();
+  ~JobSystem();
+
+  // workerCount はメインスレッド以外のスレッド数. 0 ならコア数 - 1 とする.
+  void initialize(uint32_t workerCount = 0);
+  void terminate();
+
+  // 初期化前に呼ばれた場合はその場で実行する.
+  void run(Job job, Counter* counter = nullptr);
+  // カウンタが 0 になるまで待つ. 待つ間は他のジョブを実行する.
+  void wait(Counter& counter);
+
+  // [0, count) を grain 個ずつに分けて func(first, last) を並列に呼び、完了まで待つ.
+  // grain が 0 のときはスレッド数から決める.
+  void parallelFor(uint32_t count, uint32_t grain, const std::function<void(uint32_t, uint32_t)>& func);
+
+  // メインスレッドを含めたスレッド数
+  uint32_t getThreadCount() const { return uint32_t(m_queues.size()); }
+  // 呼び出したスレッドの番号. メインスレッドは 0、ジョブシステム外のスレッドも 0 として扱う.
+  static uint32_t getThreadIndex();
+
+private:
+  struct Task
+  {
+    Job job;
+    Counter* counter;
+  };
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+  bool pop(uint32_t index, Task& task);
+  bool steal(uint32_t index, Task& task);
+  bool tryExecute(uint32_t index);
+  void workerMain(uint32_t index);
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_threads;
+  std::atomic<uint32_t> m_pending;   // キューに積まれているジョブ数
+  std::atomic<bool> m_running;
+  std::mutex m_sleepMutex;
+  std::condition_variable m_sleepCond;
+};
@@ -0,0 +1,386 @@
+﻿#include "vkappbase.h"
+#include "pipelinecache.h"
+#include <array>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <unordered_set>
+
+using namespace std;
+
+namespace
+{
+  // FNV-1a (64bit). 実行ごとに変わらない値になるよう、ポインタ以外は値の中身から求める.
+  const uint64_t FnvOffsetBasis = 14695981039346656037ull;
+  const uint64_t FnvPrime = 1099511628211ull;
+
+  void HashBytes(uint64_t& h, const void* data, size_t size)
+  {
+    auto p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+      h ^= p[i];
+      h *= FnvPrime;
+    }
+  }
+  template<class T>
+  void HashValue(uint64_t& h, const T& value)
+  {
+    HashBytes(h, &value, sizeof(value));
+  }
+  void HashString(uint64_t& h, const string& s)
+  {
+    HashValue(h, s.size());
+    HashBytes(h, s.data(), s.size());
+  }
+
+  const array<VkDynamicState, 2> DynamicStates = {
+    VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR
+  };
+
+  void CheckResult(VkResult result)
+  {
+    if (result != VK_SUCCESS)
+    {
+      DebugBreak();
+    }
+  }
+}
+
+PipelineDesc::PipelineDesc()
+  : vertexStride(0)
+  , topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+  , cullMode(VK_CULL_MODE_NONE)
+  , frontFace(VK_FRONT_FACE_COUNTER_CLOCKWISE)
+  , blend(Blend::Opaque)
+  , colorAttachmentCount(1)
+  , depthTest(VK_TRUE)
+  , depthWrite(VK_TRUE)
+  , depthCompareOp(VK_COMPARE_OP_LESS_OR_EQUAL)
+  , renderPass(VK_NULL_HANDLE)
+  , layout(VK_NULL_HANDLE)
+{
+}
+
+void PipelineDesc::addFragmentConstant(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  fragmentConstants.push_back(bits);
+}
+
+uint64_t PipelineDesc::hash() const
+{
+  // 構造体のパディングを含めないよう、メンバーごとに積み上げる.
+  uint64_t h = FnvOffsetBasis;
+  HashString(h, vertexShader);
+  HashString(h, fragmentShader);
+  HashValue(h, fragmentConstants.size());
+  for (auto v : fragmentConstants)
+  {
+    HashValue(h, v);
+  }
+  HashValue(h, vertexStride);
+  HashValue(h, vertexAttributes.size());
+  for (const auto& v : vertexAttributes)
+  {
+    HashValue(h, v.location);
+    HashValue(h, v.binding);
+    HashValue(h, v.format);
+    HashValue(h, v.offset);
+  }
+  HashValue(h, topology);
+  HashValue(h, cullMode);
+  HashValue(h, frontFace);
+  HashValue(h, blend);
+  HashValue(h, colorAttachmentCount);
+  HashValue(h, depthTest);
+  HashValue(h, depthWrite);
+  HashValue(h, depthCompareOp);
+  HashValue(h, renderPass);
+  HashValue(h, layout);
+  return h;
+}
+
+bool PipelineDesc::operator==(const PipelineDesc& rhs) const
+{
+  if (vertexAttributes.size() != rhs.vertexAttributes.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < vertexAttributes.size(); ++i)
+  {
+    const auto& a = vertexAttributes[i];
+    const auto& b = rhs.vertexAttributes[i];
+    if (a.location != b.location || a.binding != b.binding || a.format != b.format || a.offset != b.offset)
+    {
+      return false;
+    }
+  }
+  return vertexShader == rhs.vertexShader &&
+    fragmentShader == rhs.fragmentShader &&
+    fragmentConstants == rhs.fragmentConstants &&
+    vertexStride == rhs.vertexStride &&
+    topology == rhs.topology &&
+    cullMode == rhs.cullMode &&
+    frontFace == rhs.frontFace &&
+    blend == rhs.blend &&
+    colorAttachmentCount == rhs.colorAttachmentCount &&
+    depthTest == rhs.depthTest &&
+    depthWrite == rhs.depthWrite &&
+    depthCompareOp == rhs.depthCompareOp &&
+    renderPass == rhs.renderPass &&
+    layout == rhs.layout;
+}
+
+PipelineCache::PipelineCache()
+  : m_device(VK_NULL_HANDLE)
+  , m_driverCache(VK_NULL_HANDLE)
+{
+}
+
+void PipelineCache::initialize(VkDevice device)
+{
+  m_device = device;
+  m_shaderModules.initialize(device);
+
+  VkPipelineCacheCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  auto result = vkCreatePipelineCache(m_device, &ci, nullptr, &m_driverCache);
+  CheckResult(result);
+}
+
+void PipelineCache::terminate()
+{
+  for (auto& v : m_pipelines)
+  {
+    vkDestroyPipeline(m_device, v.second, nullptr);
+  }
+  m_pipelines.clear();
+  vkDestroyPipelineCache(m_device, m_driverCache, nullptr);
+  m_driverCache = VK_NULL_HANDLE;
+  m_shaderModules.terminate();
+}
+
+VkPipeline PipelineCache::getPipeline(const PipelineDesc& desc)
+{
+  auto it = m_pipelines.find(desc);
+  if (it != m_pipelines.end())
+  {
+    return it->second;
+  }
+  auto pipeline = createPipeline(desc);
+  m_pipelines.emplace(desc, pipeline);
+  return pipeline;
+}
+
+void PipelineCache::compile(const std::vector<PipelineDesc>& descs, JobSystem& jobSystem)
+{
+  // まだ作成していない記述を重複なく集める.
+  vector<PipelineDesc> pending;
+  unordered_set<PipelineDesc, PipelineDesc::Hasher> seen;
+  for (const auto& desc : descs)
+  {
+    if (m_pipelines.count(desc) == 0 && seen.insert(desc).second)
+    {
+      pending.push_back(desc);
+    }
+  }
+  if (pending.empty())
+  {
+    return;
+  }
+
+  // スレッドごとに 1 回の vkCreateGraphicsPipelines にまとめて渡す.
+  // 数がスレッド数以下なら 1 つずつ別のスレッドで作るので、かかる時間は最も重いものの分で済む.
+  auto start = glfwGetTime();
+  auto count = uint32_t(pending.size());
+  auto threads = (max)(1u, jobSystem.getThreadCount());
+  auto grain = (count + threads - 1) / threads;
+  vector<VkPipeline> pipelines(count, VK_NULL_HANDLE);
+  jobSystem.parallelFor(count, grain, [&](uint32_t first, uint32_t last) {
+    createPipelines(&pending[first], last - first, &pipelines[first]);
+  });
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    m_pipelines.emplace(pending[i], pipelines[i]);
+  }
+
+  stringstream ss;
+  ss << "pipelines compiled=" << count
+    << " batches=" << (count + grain - 1) / grain
+    << " time=" << (glfwGetTime() - start) * 1000.0 << "ms" << endl;
+  OutputDebugStringA(ss.str().c_str());
+}
+
+// 1 つのパイプラインの作成情報. ci は自身のメンバーを指すので、setup の後は移動しないこと.
+struct PipelineCache::BuildState
+{
+  VkVertexInputBindingDescription inputBinding;
+  VkPipelineVertexInputStateCreateInfo vertexInputCI;
+  VkPipelineViewportStateCreateInfo viewportCI;
+  VkPipelineDynamicStateCreateInfo dynamicStateCI;
+  VkPipelineInputAssemblyStateCreateInfo inputAssemblyCI;
+  VkPipelineRasterizationStateCreateInfo rasterizerCI;
+  VkPipelineMultisampleStateCreateInfo multisampleCI;
+  std::vector<VkPipelineColorBlendAttachmentState> blendAttachments;
+  VkPipelineColorBlendStateCreateInfo cbCI;
+  VkPipelineDepthStencilStateCreateInfo depthStencilCI;
+  std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+  std::vector<VkSpecializationMapEntry> specEntries;
+  VkSpecializationInfo specInfo;
+  VkGraphicsPipelineCreateInfo ci;
+};
+
+VkPipeline PipelineCache::createPipeline(const PipelineDesc& desc)
+{
+  VkPipeline pipeline;
+  createPipelines(&desc, 1, &pipeline);
+  return pipeline;
+}
+
+void PipelineCache::createPipelines(const PipelineDesc* descs, uint32_t count, VkPipeline* pipelines)
+{
+  vector<BuildState> states(count);
+  vector<VkGraphicsPipelineCreateInfo> createInfos(count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    setup(descs[i], states[i]);
+    createInfos[i] = states[i].ci;
+  }
+  // ドライバーのパイプラインキャッシュは内部で排他されるので、複数のスレッドから同時に渡してよい.
+  auto result = vkCreateGraphicsPipelines(m_device, m_driverCache, count, createInfos.data(), nullptr, pipelines);
+  CheckResult(result);
+}
+
+void PipelineCache::setup(const PipelineDesc& desc, BuildState& state)
+{
+  // 頂点の入力設定
+  state.inputBinding = {
+    0,                          // binding
+    desc.vertexStride,          // stride
+    VK_VERTEX_INPUT_RATE_VERTEX // inputRate
+  };
+  auto& vertexInputCI = state.vertexInputCI;
+  vertexInputCI = {};
+  vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertexInputCI.vertexBindingDescriptionCount = desc.vertexAttributes.empty() ? 0 : 1;
+  vertexInputCI.pVertexBindingDescriptions = &state.inputBinding;
+  vertexInputCI.vertexAttributeDescriptionCount = uint32_t(desc.vertexAttributes.size());
+  vertexInputCI.pVertexAttributeDescriptions = desc.vertexAttributes.data();
+
+  // ビューポートの設定
+  // ウィンドウサイズが変わってもパイプラインを作り直さずに済むよう、動的ステートとして描画時に設定する.
+  auto& viewportCI = state.viewportCI;
+  viewportCI = {};
+  viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewportCI.viewportCount = 1;
+  viewportCI.scissorCount = 1;
+  auto& dynamicStateCI = state.dynamicStateCI;
+  dynamicStateCI = {};
+  dynamicStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicStateCI.dynamicStateCount = uint32_t(DynamicStates.size());
+  dynamicStateCI.pDynamicStates = DynamicStates.data();
+
+  // プリミティブトポロジー設定
+  auto& inputAssemblyCI = state.inputAssemblyCI;
+  inputAssemblyCI = {};
+  inputAssemblyCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  inputAssemblyCI.topology = desc.topology;
+
+  // ラスタライザーステート設定
+  auto& rasterizerCI = state.rasterizerCI;
+  rasterizerCI = {};
+  rasterizerCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizerCI.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterizerCI.cullMode = desc.cullMode;
+  rasterizerCI.frontFace = desc.frontFace;
+  rasterizerCI.lineWidth = 1.0f;
+
+  // マルチサンプル設定
+  auto& multisampleCI = state.multisampleCI;
+  multisampleCI = {};
+  multisampleCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampleCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  // ブレンディングの設定. 全カラーアタッチメントで同じ設定を使う.
+  const auto colorWriteAll = \
+    VK_COLOR_COMPONENT_R_BIT | \
+    VK_COLOR_COMPONENT_G_BIT | \
+    VK_COLOR_COMPONENT_B_BIT | \
+    VK_COLOR_COMPONENT_A_BIT;
+  VkPipelineColorBlendAttachmentState blendAttachment{};
+  blendAttachment.blendEnable = VK_FALSE;
+  blendAttachment.colorWriteMask = colorWriteAll;
+  if (desc.blend == PipelineDesc::Blend::Alpha)
+  {
+    blendAttachment.blendEnable = VK_TRUE;
+    blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+  }
+  state.blendAttachments.assign(desc.colorAttachmentCount, blendAttachment);
+  auto& cbCI = state.cbCI;
+  cbCI = {};
+  cbCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  cbCI.attachmentCount = uint32_t(state.blendAttachments.size());
+  cbCI.pAttachments = state.blendAttachments.data();
+
+  // デプスステンシルステート設定
+  auto& depthStencilCI = state.depthStencilCI;
+  depthStencilCI = {};
+  depthStencilCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depthStencilCI.depthTestEnable = desc.depthTest;
+  depthStencilCI.depthCompareOp = desc.depthCompareOp;
+  depthStencilCI.depthWriteEnable = desc.depthWrite;
+  depthStencilCI.stencilTestEnable = VK_FALSE;
+
+  // シェーダーの設定
+  VkPipelineShaderStageCreateInfo stageCI{};
+  stageCI.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  stageCI.pName = "main";
+  stageCI.stage = VK_SHADER_STAGE_VERTEX_BIT;
+  stageCI.module = m_shaderModules.getModule(desc.vertexShader);
+  state.shaderStages.push_back(stageCI);
+
+  state.specInfo = {};
+  if (!desc.fragmentShader.empty())
+  {
+    stageCI.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    stageCI.module = m_shaderModules.getModule(desc.fragmentShader);
+    if (!desc.fragmentConstants.empty())
+    {
+      for (uint32_t i = 0; i < uint32_t(desc.fragmentConstants.size()); ++i)
+      {
+        state.specEntries.push_back({ i, uint32_t(i * sizeof(uint32_t)), sizeof(uint32_t) });
+      }
+      auto& specInfo = state.specInfo;
+      specInfo.mapEntryCount = uint32_t(state.specEntries.size());
+      specInfo.pMapEntries = state.specEntries.data();
+      specInfo.dataSize = desc.fragmentConstants.size() * sizeof(uint32_t);
+      specInfo.pData = desc.fragmentConstants.data();
+      stageCI.pSpecializationInfo = &state.specInfo;
+    }
+    state.shaderStages.push_back(stageCI);
+  }
+
+  // パイプラインの構築
+  auto& ci = state.ci;
+  ci = {};
+  ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  ci.stageCount = uint32_t(state.shaderStages.size());
+  ci.pStages = state.shaderStages.data();
+  ci.pInputAssemblyState = &inputAssemblyCI;
+  ci.pVertexInputState = &vertexInputCI;
+  ci.pRasterizationState = &rasterizerCI;
+  ci.pDepthStencilState = &depthStencilCI;
+  ci.pMultisampleState = &multisampleCI;
+  ci.pViewportState = &viewportCI;
+  ci.pDynamicState = &dynamicStateCI;
+  ci.pColorBlendState = &cbCI;
+  ci.renderPass = desc.renderPass;
+  ci.layout = desc.layout;
+}
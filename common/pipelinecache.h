@@ -0,0 +1,86 @@
+﻿#pragma once
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include "jobsystem.h"
+#include "shadercache.h"
+
+// グラフィックスパイプラインの記述.
+// パイプラインの違いになる状態だけを持ち、ビューポート・シザーは動的ステート、サンプル数は 1 で固定.
+// 同じ内容の記述は同じハッシュ値になるので、PipelineCache のキーとして使う.
+struct PipelineDesc
+{
+  enum class Blend
+  {
+    Opaque,   // ブレンドなし (書き込みのみ)
+    Alpha,    // src * a + dst * (1 - a)
+  };
+
+  // シェーダー (.spv のファイル名). fragmentShader が空ならフラグメントシェーダーを使わない.
+  std::string vertexShader;
+  std::string fragmentShader;
+  // フラグメントシェーダーの特殊化定数. i 番目の値を constant_id = i として 4 バイトで渡す.
+  std::vector<uint32_t> fragmentConstants;
+
+  // 頂点の入力 (binding 0 のみ)
+  uint32_t vertexStride;
+  std::vector<VkVertexInputAttributeDescription> vertexAttributes;
+  VkPrimitiveTopology topology;
+
+  VkCullModeFlags cullMode;
+  VkFrontFace frontFace;
+
+  Blend blend;
+  uint32_t colorAttachmentCount;   // 深度だけのパスでは 0
+
+  VkBool32 depthTest;
+  VkBool32 depthWrite;
+  VkCompareOp depthCompareOp;
+
+  VkRenderPass renderPass;
+  VkPipelineLayout layout;
+
+  PipelineDesc();
+  void addFragmentConstant(float value);
+
+  uint64_t hash() const;
+  bool operator==(const PipelineDesc& rhs) const;
+  bool operator!=(const PipelineDesc& rhs) const { return !(*this == rhs); }
+
+  struct Hasher
+  {
+    size_t operator()(const PipelineDesc& desc) const { return size_t(desc.hash()); }
+  };
+};
+
+// 記述からパイプラインを引くキャッシュ.
+// 初めての記述のときだけパイプラインを作成し、同じ記述のパイプラインは 1 つにまとめる.
+// 作成したパイプラインはキャッシュが所有し、terminate でまとめて破棄する.
+// getPipeline はメインスレッドから呼ぶこと. 並列に作成するのは compile の内部だけ.
+class PipelineCache
+{
+public:
+  PipelineCache();
+  void initialize(VkDevice device);
+  void terminate();
+
+  VkPipeline getPipeline(const PipelineDesc& desc);
+  // 使うことが分かっている記述をまとめて、ジョブシステムのスレッドで並列に作成しておく.
+  // 作成済みと重複は除く. 作成後は getPipeline で引ける.
+  void compile(const std::vector<PipelineDesc>& descs, JobSystem& jobSystem);
+  size_t getPipelineCount() const { return m_pipelines.size(); }
+
+private:
+  struct BuildState;
+  VkPipeline createPipeline(const PipelineDesc& desc);
+  // count 個のパイプラインを 1 回の vkCreateGraphicsPipelines で作成する. 複数のスレッドから呼んでよい.
+  void createPipelines(const PipelineDesc* descs, uint32_t count, VkPipeline* pipelines);
+  void setup(const PipelineDesc& desc, BuildState& state);
+
+  VkDevice m_device;
+  VkPipelineCache m_driverCache;   // ドライバーのパイプラインキャッシュ. 全スレッドで共有する.
+  // シェーダーモジュールはパイプラインの作成後も破棄せず、別の組み合わせの作成で使いまわす.
+  ShaderModuleCache m_shaderModules;
+  std::unordered_map<PipelineDesc, VkPipeline, PipelineDesc::Hasher> m_pipelines;
+};
@@ -0,0 +1,882 @@
+﻿#include "vkappbase.h"
+#include "rendergraph.h"
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+  const VkAccessFlags WriteAccessMask =
+    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT |
+    VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+  const uint32_t NoPass = ~0u;
+
+  void CheckResult(VkResult result)
+  {
+    if (result != VK_SUCCESS)
+    {
+      DebugBreak();
+    }
+  }
+
+  VkImageUsageFlags GetImageUsageBits(RenderGraph::Usage usage)
+  {
+    using Usage = RenderGraph::Usage;
+    switch (usage)
+    {
+    case Usage::ColorAttachment: return VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    case Usage::DepthAttachment:
+    case Usage::DepthReadOnly: return VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    case Usage::SampledFragment:
+    case Usage::SampledCompute: return VK_IMAGE_USAGE_SAMPLED_BIT;
+    case Usage::StorageReadCompute:
+    case Usage::StorageWriteCompute: return VK_IMAGE_USAGE_STORAGE_BIT;
+    case Usage::TransferSrc: return VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    case Usage::TransferDst: return VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    default: return 0;
+    }
+  }
+
+  VkDeviceSize AlignUp(VkDeviceSize v, VkDeviceSize alignment)
+  {
+    return (v + alignment - 1) / alignment * alignment;
+  }
+}
+
+RenderGraph::State RenderGraph::GetUsageState(Usage usage)
+{
+  switch (usage)
+  {
+  case Usage::ColorAttachment:
+    return { VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT };
+  case Usage::DepthAttachment:
+    return { VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT };
+  case Usage::DepthReadOnly:
+    // シェーダーからは書かないが、ストア操作 (STORE / DONT_CARE) は深度の書き込みとして扱われる.
+    return { VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT };
+  case Usage::SampledFragment:
+    return { VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT };
+  case Usage::SampledCompute:
+    return { VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT };
+  case Usage::StorageReadCompute:
+    return { VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT };
+  case Usage::StorageWriteCompute:
+    return { VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT };
+  case Usage::TransferSrc:
+    return { VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT };
+  case Usage::TransferDst:
+    return { VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT };
+  case Usage::Present:
+  default:
+    // 表示エンジンへの受け渡しはセマフォで同期されるので、アクセスは不要.
+    return { VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0 };
+  }
+}
+
+bool RenderGraph::IsWriteUsage(Usage usage)
+{
+  return (GetUsageState(usage).access & WriteAccessMask) != 0;
+}
+
+void RenderGraph::PassBuilder::colorAttachment(Handle h, VkAttachmentLoadOp loadOp, VkClearColorValue clear)
+{
+  auto& pass = m_graph.m_passes[m_pass];
+  Attachment attachment{};
+  attachment.handle = h;
+  attachment.loadOp = loadOp;
+  attachment.clear.color = clear;
+  pass.colors.push_back(attachment);
+  pass.accesses.push_back({ h, Usage::ColorAttachment });
+  pass.writes.push_back(h);
+  if (loadOp == VK_ATTACHMENT_LOAD_OP_LOAD)
+  {
+    pass.reads.push_back(h);
+  }
+}
+void RenderGraph::PassBuilder::depthAttachment(Handle h, VkAttachmentLoadOp loadOp, VkClearDepthStencilValue clear)
+{
+  auto& pass = m_graph.m_passes[m_pass];
+  pass.depth.handle = h;
+  pass.depth.loadOp = loadOp;
+  pass.depth.clear.depthStencil = clear;
+  pass.hasDepth = true;
+  pass.depthReadOnly = false;
+  pass.accesses.push_back({ h, Usage::DepthAttachment });
+  pass.writes.push_back(h);
+  if (loadOp == VK_ATTACHMENT_LOAD_OP_LOAD)
+  {
+    pass.reads.push_back(h);
+  }
+}
+void RenderGraph::PassBuilder::depthReadOnly(Handle h)
+{
+  auto& pass = m_graph.m_passes[m_pass];
+  pass.depth.handle = h;
+  pass.depth.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+  pass.hasDepth = true;
+  pass.depthReadOnly = true;
+  pass.accesses.push_back({ h, Usage::DepthReadOnly });
+  pass.reads.push_back(h);
+}
+void RenderGraph::PassBuilder::read(Handle h, Usage usage)
+{
+  auto& pass = m_graph.m_passes[m_pass];
+  pass.accesses.push_back({ h, usage });
+  pass.reads.push_back(h);
+}
+void RenderGraph::PassBuilder::write(Handle h, Usage usage)
+{
+  auto& pass = m_graph.m_passes[m_pass];
+  pass.accesses.push_back({ h, usage });
+  pass.writes.push_back(h);
+}
+void RenderGraph::PassBuilder::useSecondaryCommandBuffers(bool enable)
+{
+  m_graph.m_passes[m_pass].secondary = enable;
+}
+void RenderGraph::PassBuilder::setSideEffect()
+{
+  m_graph.m_passes[m_pass].sideEffect = true;
+}
+
+RenderGraph::RenderGraph()
+  : m_device(VK_NULL_HANDLE)
+  , m_memProps()
+  , m_transientMemory(VK_NULL_HANDLE)
+  , m_transientMemorySize(0)
+  , m_transientMemoryUnaliased(0)
+{
+}
+
+void RenderGraph::initialize(VkDevice device, VkPhysicalDevice physDev)
+{
+  m_device = device;
+  vkGetPhysicalDeviceMemoryProperties(physDev, &m_memProps);
+}
+
+void RenderGraph::terminate()
+{
+  // 呼び出し側で GPU の完了を待ってから呼ぶこと.
+  m_releaseHandler = nullptr;
+  destroyTransients();
+  releaseFramebuffers();
+  for (auto& v : m_renderPasses)
+  {
+    vkDestroyRenderPass(m_device, v.second, nullptr);
+  }
+  m_renderPasses.clear();
+  reset();
+}
+
+void RenderGraph::reset()
+{
+  m_passes.clear();
+  m_resources.clear();
+  m_finalBarriers.clear();
+}
+
+RenderGraph::Handle RenderGraph::importImage(const char* name, VkImage image, VkImageView view, const ImageDesc& desc, const State& initial)
+{
+  Resource res{};
+  res.name = name;
+  res.desc = desc;
+  res.imported = true;
+  res.image = image;
+  res.view = view;
+  res.initial = initial;
+  m_resources.push_back(res);
+  return Handle(m_resources.size() - 1);
+}
+
+RenderGraph::Handle RenderGraph::createImage(const char* name, const ImageDesc& desc)
+{
+  Resource res{};
+  res.name = name;
+  res.desc = desc;
+  res.imported = false;
+  m_resources.push_back(res);
+  return Handle(m_resources.size() - 1);
+}
+
+void RenderGraph::addPass(const char* name, const function<void(PassBuilder&)>& setup, ExecuteFunc execute)
+{
+  Pass pass{};
+  pass.name = name;
+  pass.execute = execute;
+  m_passes.push_back(pass);
+  PassBuilder builder(*this, uint32_t(m_passes.size() - 1));
+  setup(builder);
+}
+
+void RenderGraph::setFinalUsage(Handle h, Usage usage)
+{
+  m_resources[h].hasFinalUsage = true;
+  m_resources[h].finalUsage = usage;
+}
+
+void RenderGraph::compile()
+{
+  cullPasses();
+  computeLifetimes();
+  auto reallocated = allocateTransients();
+  computeBarriers();
+
+  // 描画パスのレンダーパスを決める.
+  for (uint32_t i = 0; i < uint32_t(m_passes.size()); ++i)
+  {
+    auto& pass = m_passes[i];
+    pass.renderPass = VK_NULL_HANDLE;
+    if (pass.culled || (pass.colors.empty() && !pass.hasDepth))
+    {
+      continue;
+    }
+    // 後で読まれない一時イメージは書き戻さない.
+    RenderPassDesc desc{};
+    for (const auto& v : pass.colors)
+    {
+      AttachmentDesc attachment{};
+      attachment.format = m_resources[v.handle].desc.format;
+      attachment.loadOp = v.loadOp;
+      attachment.storeOp = isReadAfter(v.handle, i) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      attachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      desc.colors.push_back(attachment);
+    }
+    desc.depth.format = VK_FORMAT_UNDEFINED;
+    if (pass.hasDepth)
+    {
+      desc.depth.format = m_resources[pass.depth.handle].desc.format;
+      desc.depth.loadOp = pass.depth.loadOp;
+      // 読み取り専用なら内容は変わらないので、後で読まれなくても書き戻して内容を壊さない.
+      desc.depth.storeOp = (pass.depthReadOnly || isReadAfter(pass.depth.handle, i)) ?
+        VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      desc.depth.layout = pass.depthReadOnly ?
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    }
+    pass.renderPass = getRenderPass(desc);
+  }
+
+  if (reallocated)
+  {
+    report();
+  }
+}
+
+void RenderGraph::cullPasses()
+{
+  // 参照カウントで出力に届かないパスを取り除く.
+  // パスの参照数は書き込むリソースの数、リソースの参照数は読むパスの数 (+出力なら 1).
+  vector<uint32_t> passRefs(m_passes.size()), resourceRefs(m_resources.size());
+  for (uint32_t i = 0; i < uint32_t(m_passes.size()); ++i)
+  {
+    auto& pass = m_passes[i];
+    pass.culled = false;
+    passRefs[i] = uint32_t(pass.writes.size()) + (pass.sideEffect ? 1 : 0);
+    for (auto h : pass.reads)
+    {
+      resourceRefs[h]++;
+    }
+  }
+  vector<Handle> unreferenced;
+  for (Handle h = 0; h < Handle(m_resources.size()); ++h)
+  {
+    if (m_resources[h].hasFinalUsage)
+    {
+      resourceRefs[h]++;
+    }
+    if (resourceRefs[h] == 0)
+    {
+      unreferenced.push_back(h);
+    }
+  }
+
+  auto cull = [&](Pass& pass) {
+    pass.culled = true;
+    for (auto h : pass.reads)
+    {
+      if (--resourceRefs[h] == 0)
+      {
+        unreferenced.push_back(h);
+      }
+    }
+  };
+  for (uint32_t i = 0; i < uint32_t(m_passes.size()); ++i)
+  {
+    if (passRefs[i] == 0)
+    {
+      cull(m_passes[i]);
+    }
+  }
+  while (!unreferenced.empty())
+  {
+    auto h = unreferenced.back();
+    unreferenced.pop_back();
+    for (uint32_t i = 0; i < uint32_t(m_passes.size()); ++i)
+    {
+      auto& pass = m_passes[i];
+      if (pass.culled)
+      {
+        continue;
+      }
+      for (auto w : pass.writes)
+      {
+        if (w == h && --passRefs[i] == 0)
+        {
+          cull(pass);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void RenderGraph::computeLifetimes()
+{
+  for (auto& res : m_resources)
+  {
+    res.firstPass = NoPass;
+    res.lastPass = NoPass;
+  }
+  for (uint32_t i = 0; i < uint32_t(m_passes.size()); ++i)
+  {
+    if (m_passes[i].culled)
+    {
+      continue;
+    }
+    for (const auto& a : m_passes[i].accesses)
+    {
+      auto& res = m_resources[a.handle];
+      if (res.firstPass == NoPass)
+      {
+        res.firstPass = i;
+      }
+      res.lastPass = i;
+      if (!res.imported)
+      {
+        res.desc.usage |= GetImageUsageBits(a.usage);
+      }
+    }
+  }
+}
+
+bool RenderGraph::allocateTransients()
+{
+  // 今回必要な一時イメージ. 前回と同じなら作り直さない.
+  vector<TransientImage> wanted;
+  vector<Handle> owners;
+  for (Handle h = 0; h < Handle(m_resources.size()); ++h)
+  {
+    const auto& res = m_resources[h];
+    if (res.imported || res.firstPass == NoPass)
+    {
+      continue;
+    }
+    TransientImage t{};
+    t.name = res.name;
+    t.desc = res.desc;
+    t.firstPass = res.firstPass;
+    t.lastPass = res.lastPass;
+    wanted.push_back(t);
+    owners.push_back(h);
+  }
+  auto same = wanted.size() == m_transients.size() &&
+    equal(wanted.begin(), wanted.end(), m_transients.begin(), [](const TransientImage& a, const TransientImage& b) {
+      return a.name == b.name &&
+        a.desc.format == b.desc.format && a.desc.aspect == b.desc.aspect && a.desc.usage == b.desc.usage &&
+        a.desc.extent.width == b.desc.extent.width && a.desc.extent.height == b.desc.extent.height &&
+        a.firstPass == b.firstPass && a.lastPass == b.lastPass;
+    });
+
+  if (!same)
+  {
+    destroyTransients();
+    m_transients = wanted;
+
+    // イメージを作ってメモリ要求を集める.
+    uint32_t typeBits = ~0u;
+    vector<VkDeviceSize> alignments(m_transients.size());
+    for (size_t i = 0; i < m_transients.size(); ++i)
+    {
+      auto& t = m_transients[i];
+      VkImageCreateInfo ci{};
+      ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+      ci.imageType = VK_IMAGE_TYPE_2D;
+      ci.format = t.desc.format;
+      ci.extent = { t.desc.extent.width, t.desc.extent.height, 1 };
+      ci.mipLevels = 1;
+      ci.arrayLayers = 1;
+      ci.samples = VK_SAMPLE_COUNT_1_BIT;
+      ci.usage = t.desc.usage;
+      // 同じメモリを別のイメージと共有するので、内容は使用期間の初めに未定義となる.
+      ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      auto result = vkCreateImage(m_device, &ci, nullptr, &t.image);
+      CheckResult(result);
+
+      VkMemoryRequirements reqs;
+      vkGetImageMemoryRequirements(m_device, t.image, &reqs);
+      t.size = reqs.size;
+      alignments[i] = reqs.alignment;
+      typeBits &= reqs.memoryTypeBits;
+    }
+
+    // 大きいものから順に、使用期間が重なるものと領域がぶつからない一番低い位置へ置く.
+    vector<size_t> order(m_transients.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+      order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return m_transients[a].size > m_transients[b].size;
+    });
+    auto overlapLifetime = [](const TransientImage& a, const TransientImage& b) {
+      return !(a.lastPass < b.firstPass || b.lastPass < a.firstPass);
+    };
+    vector<size_t> placed;
+    m_transientMemorySize = 0;
+    m_transientMemoryUnaliased = 0;
+    for (auto i : order)
+    {
+      auto& t = m_transients[i];
+      vector<VkDeviceSize> candidates = { 0 };
+      for (auto j : placed)
+      {
+        if (overlapLifetime(t, m_transients[j]))
+        {
+          candidates.push_back(AlignUp(m_transients[j].offset + m_transients[j].size, alignments[i]));
+        }
+      }
+      sort(candidates.begin(), candidates.end());
+      for (auto offset : candidates)
+      {
+        auto conflict = any_of(placed.begin(), placed.end(), [&](size_t j) {
+          const auto& other = m_transients[j];
+          return overlapLifetime(t, other) &&
+            offset < other.offset + other.size && other.offset < offset + t.size;
+        });
+        if (!conflict)
+        {
+          t.offset = offset;
+          break;
+        }
+      }
+      placed.push_back(i);
+      m_transientMemorySize = (max)(m_transientMemorySize, t.offset + t.size);
+      m_transientMemoryUnaliased += t.size;
+    }
+
+    if (!m_transients.empty())
+    {
+      // 最適タイリングのデバイスローカルなイメージは共通のメモリタイプを持つことを前提とする.
+      VkMemoryAllocateInfo ai{};
+      ai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+      ai.allocationSize = m_transientMemorySize;
+      ai.memoryTypeIndex = getMemoryTypeIndex(typeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      auto result = vkAllocateMemory(m_device, &ai, nullptr, &m_transientMemory);
+      CheckResult(result);
+    }
+    for (auto& t : m_transients)
+    {
+      vkBindImageMemory(m_device, t.image, m_transientMemory, t.offset);
+
+      VkImageViewCreateInfo ci{};
+      ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+      ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+      ci.image = t.image;
+      ci.format = t.desc.format;
+      ci.components = {
+        VK_COMPONENT_SWIZZLE_R,
+        VK_COMPONENT_SWIZZLE_G,
+        VK_COMPONENT_SWIZZLE_B,
+        VK_COMPONENT_SWIZZLE_A,
+      };
+      ci.subresourceRange = { t.desc.aspect, 0, 1, 0, 1 };
+      auto result = vkCreateImageView(m_device, &ci, nullptr, &t.view);
+      CheckResult(result);
+    }
+  }
+
+  for (size_t i = 0; i < owners.size(); ++i)
+  {
+    auto& res = m_resources[owners[i]];
+    res.transient = uint32_t(i);
+    res.image = m_transients[i].image;
+    res.view = m_transients[i].view;
+  }
+  return !same;
+}
+
+vector<RenderGraph::State> RenderGraph::simulate(bool record)
+{
+  // パスの順にリソースの状態を追い、必要な箇所でバリアを作る.
+  // 読み込みが続く間はバリアを張らず、ステージとアクセスを足していく.
+  vector<State> states(m_resources.size());
+  for (size_t i = 0; i < m_resources.size(); ++i)
+  {
+    states[i] = m_resources[i].initial;
+  }
+  auto transition = [&](Handle h, Usage usage, vector<Barrier>* barriers) {
+    auto& state = states[h];
+    auto next = GetUsageState(usage);
+    if (state.layout != next.layout || (state.access & WriteAccessMask) != 0 || IsWriteUsage(usage))
+    {
+      if (barriers)
+      {
+        barriers->push_back({ h, state, next });
+      }
+      state = next;
+    }
+    else
+    {
+      state.stage |= next.stage;
+      state.access |= next.access;
+    }
+  };
+
+  for (auto& pass : m_passes)
+  {
+    pass.barriers.clear();
+    if (pass.culled)
+    {
+      continue;
+    }
+    for (const auto& a : pass.accesses)
+    {
+      transition(a.handle, a.usage, record ? &pass.barriers : nullptr);
+    }
+  }
+  if (record)
+  {
+    m_finalBarriers.clear();
+  }
+  for (Handle h = 0; h < Handle(m_resources.size()); ++h)
+  {
+    if (m_resources[h].hasFinalUsage)
+    {
+      transition(h, m_resources[h].finalUsage, record ? &m_finalBarriers : nullptr);
+    }
+  }
+  return states;
+}
+
+void RenderGraph::computeBarriers()
+{
+  // 一時イメージの最初のバリアは、前のフレームでの自分と同じメモリを使う他のイメージの
+  // 最後の使用を待つ必要がある. そのため 1 度空回しして最後の状態を求めておく.
+  auto finals = simulate(false);
+  for (Handle h = 0; h < Handle(m_resources.size()); ++h)
+  {
+    auto& res = m_resources[h];
+    if (res.imported)
+    {
+      continue;
+    }
+    res.initial = { VK_IMAGE_LAYOUT_UNDEFINED, 0, 0 };
+    if (res.firstPass == NoPass)
+    {
+      continue;
+    }
+    const auto& t = m_transients[res.transient];
+    for (Handle o = 0; o < Handle(m_resources.size()); ++o)
+    {
+      const auto& other = m_resources[o];
+      if (other.imported || other.firstPass == NoPass)
+      {
+        continue;
+      }
+      const auto& ot = m_transients[other.transient];
+      if (t.offset < ot.offset + ot.size && ot.offset < t.offset + t.size)
+      {
+        res.initial.stage |= finals[o].stage;
+        res.initial.access |= finals[o].access & WriteAccessMask;
+      }
+    }
+  }
+  simulate(true);
+}
+
+void RenderGraph::recordBarriers(VkCommandBuffer command, const vector<Barrier>& barriers)
+{
+  if (barriers.empty())
+  {
+    return;
+  }
+  // synchronization2 が有効ならバリアごとのステージで記録される.
+  vector<ResourceStateTracker::ImageBarrier> imbs;
+  for (const auto& b : barriers)
+  {
+    const auto& res = m_resources[b.handle];
+    ResourceStateTracker::ImageBarrier imb{};
+    imb.image = res.image;
+    imb.range = { res.desc.aspect, 0, 1, 0, 1 };
+    imb.src = { b.src.stage, b.src.access, b.src.layout };
+    imb.dst = { b.dst.stage, b.dst.access, b.dst.layout };
+    imb.srcFamily = VK_QUEUE_FAMILY_IGNORED;
+    imb.dstFamily = VK_QUEUE_FAMILY_IGNORED;
+    imbs.push_back(imb);
+  }
+  ResourceStateTracker::RecordBarriers(command, imbs, {});
+}
+
+void RenderGraph::execute(VkCommandBuffer command)
+{
+  for (auto& pass : m_passes)
+  {
+    if (pass.culled)
+    {
+      continue;
+    }
+    recordBarriers(command, pass.barriers);
+
+    PassContext context{};
+    if (pass.renderPass == VK_NULL_HANDLE)
+    {
+      pass.execute(command, context);
+      continue;
+    }
+
+    auto first = pass.colors.empty() ? pass.depth.handle : pass.colors[0].handle;
+    context.renderPass = pass.renderPass;
+    context.extent = m_resources[first].desc.extent;
+    context.framebuffer = getFramebuffer(pass, context.extent);
+
+    vector<VkClearValue> clearValues;
+    for (const auto& v : pass.colors)
+    {
+      clearValues.push_back(v.clear);
+    }
+    if (pass.hasDepth)
+    {
+      clearValues.push_back(pass.depth.clear);
+    }
+    VkRenderPassBeginInfo renderPassBI{};
+    renderPassBI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassBI.renderPass = context.renderPass;
+    renderPassBI.framebuffer = context.framebuffer;
+    renderPassBI.renderArea.offset = VkOffset2D{ 0, 0 };
+    renderPassBI.renderArea.extent = context.extent;
+    renderPassBI.pClearValues = clearValues.data();
+    renderPassBI.clearValueCount = uint32_t(clearValues.size());
+    vkCmdBeginRenderPass(command, &renderPassBI,
+      pass.secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+    pass.execute(command, context);
+    vkCmdEndRenderPass(command);
+  }
+  recordBarriers(command, m_finalBarriers);
+}
+
+VkRenderPass RenderGraph::getRenderPass(const RenderPassDesc& desc)
+{
+  vector<uint64_t> key;
+  auto addKey = [&key](const AttachmentDesc& v) {
+    key.push_back(uint64_t(v.format));
+    key.push_back(uint64_t(v.loadOp));
+    key.push_back(uint64_t(v.storeOp));
+    key.push_back(uint64_t(v.layout));
+  };
+  for (const auto& v : desc.colors)
+  {
+    addKey(v);
+  }
+  key.push_back(~0ull);
+  if (desc.depth.format != VK_FORMAT_UNDEFINED)
+  {
+    addKey(desc.depth);
+  }
+  auto it = m_renderPasses.find(key);
+  if (it != m_renderPasses.end())
+  {
+    return it->second;
+  }
+
+  // レイアウトの遷移はグラフのバリアで行うので、レンダーパスの前後でレイアウトは変えない.
+  vector<VkAttachmentDescription> attachments;
+  vector<VkAttachmentReference> colorReferences;
+  VkAttachmentReference depthReference{};
+  auto addAttachment = [&attachments](const AttachmentDesc& v) {
+    VkAttachmentDescription attachment{};
+    attachment.format = v.format;
+    attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment.loadOp = v.loadOp;
+    attachment.storeOp = v.storeOp;
+    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = v.layout;
+    attachment.finalLayout = v.layout;
+    attachments.push_back(attachment);
+    return VkAttachmentReference{ uint32_t(attachments.size() - 1), v.layout };
+  };
+  for (const auto& v : desc.colors)
+  {
+    colorReferences.push_back(addAttachment(v));
+  }
+  VkSubpassDescription subpassDesc{};
+  subpassDesc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpassDesc.colorAttachmentCount = uint32_t(colorReferences.size());
+  subpassDesc.pColorAttachments = colorReferences.data();
+  if (desc.depth.format != VK_FORMAT_UNDEFINED)
+  {
+    depthReference = addAttachment(desc.depth);
+    subpassDesc.pDepthStencilAttachment = &depthReference;
+  }
+
+  VkRenderPassCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  ci.attachmentCount = uint32_t(attachments.size());
+  ci.pAttachments = attachments.data();
+  ci.subpassCount = 1;
+  ci.pSubpasses = &subpassDesc;
+  VkRenderPass renderPass;
+  auto result = vkCreateRenderPass(m_device, &ci, nullptr, &renderPass);
+  CheckResult(result);
+  m_renderPasses[key] = renderPass;
+  return renderPass;
+}
+
+VkFramebuffer RenderGraph::getFramebuffer(const Pass& pass, VkExtent2D extent)
+{
+  vector<VkImageView> views;
+  for (const auto& v : pass.colors)
+  {
+    views.push_back(m_resources[v.handle].view);
+  }
+  if (pass.hasDepth)
+  {
+    views.push_back(m_resources[pass.depth.handle].view);
+  }
+  vector<uint64_t> key = { (uint64_t)pass.renderPass, extent.width, extent.height };
+  for (auto v : views)
+  {
+    key.push_back((uint64_t)v);
+  }
+  auto it = m_framebuffers.find(key);
+  if (it != m_framebuffers.end())
+  {
+    return it->second;
+  }
+
+  VkFramebufferCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  ci.renderPass = pass.renderPass;
+  ci.width = extent.width;
+  ci.height = extent.height;
+  ci.layers = 1;
+  ci.attachmentCount = uint32_t(views.size());
+  ci.pAttachments = views.data();
+  VkFramebuffer framebuffer;
+  auto result = vkCreateFramebuffer(m_device, &ci, nullptr, &framebuffer);
+  CheckResult(result);
+  m_framebuffers[key] = framebuffer;
+  return framebuffer;
+}
+
+void RenderGraph::releaseFramebuffers()
+{
+  vector<VkFramebuffer> framebuffers;
+  for (auto& v : m_framebuffers)
+  {
+    framebuffers.push_back(v.second);
+  }
+  m_framebuffers.clear();
+  auto device = m_device;
+  release([device, framebuffers]() {
+    for (auto v : framebuffers)
+    {
+      vkDestroyFramebuffer(device, v, nullptr);
+    }
+  });
+}
+
+bool RenderGraph::isReadAfter(Handle h, uint32_t pass) const
+{
+  const auto& res = m_resources[h];
+  if (res.imported || res.hasFinalUsage)
+  {
+    return true;
+  }
+  for (uint32_t i = pass + 1; i < uint32_t(m_passes.size()); ++i)
+  {
+    if (!m_passes[i].culled && find(m_passes[i].reads.begin(), m_passes[i].reads.end(), h) != m_passes[i].reads.end())
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RenderGraph::release(function<void()> func)
+{
+  if (m_releaseHandler)
+  {
+    m_releaseHandler(func);
+  }
+  else
+  {
+    func();
+  }
+}
+
+void RenderGraph::destroyTransients()
+{
+  // ビューを参照するフレームバッファも一緒に破棄する.
+  releaseFramebuffers();
+  auto device = m_device;
+  auto transients = m_transients;
+  auto memory = m_transientMemory;
+  release([device, transients, memory]() {
+    for (auto& v : transients)
+    {
+      vkDestroyImageView(device, v.view, nullptr);
+      vkDestroyImage(device, v.image, nullptr);
+    }
+    if (memory != VK_NULL_HANDLE)
+    {
+      vkFreeMemory(device, memory, nullptr);
+    }
+  });
+  m_transients.clear();
+  m_transientMemory = VK_NULL_HANDLE;
+}
+
+uint32_t RenderGraph::getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropertyFlags requestProps) const
+{
+  uint32_t result = ~0u;
+  for (uint32_t i = 0; i < m_memProps.memoryTypeCount; ++i)
+  {
+    if (requestBits & 1)
+    {
+      const auto& types = m_memProps.memoryTypes[i];
+      if ((types.propertyFlags & requestProps) == requestProps)
+      {
+        result = i;
+        break;
+      }
+    }
+    requestBits >>= 1;
+  }
+  return result;
+}
+
+void RenderGraph::report() const
+{
+  uint32_t culled = 0, barriers = uint32_t(m_finalBarriers.size());
+  for (const auto& v : m_passes)
+  {
+    culled += v.culled ? 1 : 0;
+    barriers += uint32_t(v.barriers.size());
+  }
+  stringstream ss;
+  ss << "RenderGraph: passes=" << m_passes.size() << " culled=" << culled
+    << " barriers=" << barriers
+    << " transient=" << m_transients.size()
+    << " memory=" << m_transientMemorySize / 1024 << "KB"
+    << " (without aliasing " << m_transientMemoryUnaliased / 1024 << "KB)" << endl;
+  OutputDebugStringA(ss.str().c_str());
+}
@@ -0,0 +1,204 @@
+﻿#pragma once
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <functional>
+
+// フレームグラフ.
+// パスごとに読み書きするイメージを宣言しておくと、compile で次のことを行う.
+//  - 出力に寄与しないパスを取り除く.
+//  - パスの間に必要なバリアを求め、パスごとに 1 回のバリアコマンドにまとめる.
+//  - 一時イメージのうち、使用期間が重ならないものに同じメモリを割り当てる.
+// グラフはフレームごとに組み立てなおす. 一時イメージとレンダーパス・フレームバッファは
+// 内容が変わらない限り使いまわす.
+class RenderGraph
+{
+public:
+  using Handle = uint32_t;
+  static const Handle InvalidHandle = ~0u;
+
+  // リソースの使い方. レイアウト・ステージ・アクセスはここから決まる.
+  enum class Usage
+  {
+    ColorAttachment,
+    DepthAttachment,
+    DepthReadOnly,
+    SampledFragment,
+    SampledCompute,
+    StorageReadCompute,
+    StorageWriteCompute,
+    TransferSrc,
+    TransferDst,
+    Present,
+  };
+  // イメージの状態
+  struct State
+  {
+    VkImageLayout layout;
+    VkPipelineStageFlags stage;
+    VkAccessFlags access;
+  };
+  static State GetUsageState(Usage usage);
+  static bool IsWriteUsage(Usage usage);
+
+  struct ImageDesc
+  {
+    VkFormat format;
+    VkExtent2D extent;
+    VkImageAspectFlags aspect;
+    VkImageUsageFlags usage;  // 一時イメージでは宣言された使い方の分が自動で追加される
+  };
+  // レンダーパスの形. パイプラインの作成時に互換のレンダーパスを得るのにも使う.
+  struct AttachmentDesc
+  {
+    VkFormat format;
+    VkAttachmentLoadOp loadOp;
+    VkAttachmentStoreOp storeOp;
+    VkImageLayout layout;
+  };
+  struct RenderPassDesc
+  {
+    std::vector<AttachmentDesc> colors;
+    AttachmentDesc depth;   // format が VK_FORMAT_UNDEFINED なら深度なし
+  };
+  struct PassContext
+  {
+    VkRenderPass  renderPass;   // 描画パス以外では VK_NULL_HANDLE
+    VkFramebuffer framebuffer;
+    VkExtent2D    extent;
+  };
+  using ExecuteFunc = std::function<void(VkCommandBuffer, const PassContext&)>;
+
+  class PassBuilder
+  {
+  public:
+    // アタッチメントを指定すると描画パスになり、グラフがレンダーパスを開始・終了する.
+    void colorAttachment(Handle h, VkAttachmentLoadOp loadOp, VkClearColorValue clear = {});
+    void depthAttachment(Handle h, VkAttachmentLoadOp loadOp, VkClearDepthStencilValue clear = { 1.0f, 0 });
+    // 書き込まない深度 (深度プリパスの結果で判定するときなど)
+    void depthReadOnly(Handle h);
+    void read(Handle h, Usage usage);
+    void write(Handle h, Usage usage);
+    // レンダーパスをセカンダリコマンドバッファ用に開始する.
+    void useSecondaryCommandBuffers(bool enable);
+    // 出力がなくても取り除かない.
+    void setSideEffect();
+  private:
+    friend class RenderGraph;
+    PassBuilder(RenderGraph& graph, uint32_t pass) : m_graph(graph), m_pass(pass) { }
+    RenderGraph& m_graph;
+    uint32_t m_pass;
+  };
+
+  RenderGraph();
+  void initialize(VkDevice device, VkPhysicalDevice physDev);
+  void terminate();
+  // 使用中かもしれないオブジェクトの破棄を GPU の完了まで遅らせるための関数を設定する.
+  void setReleaseHandler(std::function<void(std::function<void()>)> handler) { m_releaseHandler = handler; }
+
+  // グラフの組み立て
+  void reset();
+  Handle importImage(const char* name, VkImage image, VkImageView view, const ImageDesc& desc, const State& initial);
+  Handle createImage(const char* name, const ImageDesc& desc);
+  void addPass(const char* name, const std::function<void(PassBuilder&)>& setup, ExecuteFunc execute);
+  // グラフの実行後に指定の使い方へ遷移させる. このリソースは出力として扱われる.
+  void setFinalUsage(Handle h, Usage usage);
+  void present(Handle h) { setFinalUsage(h, Usage::Present); }
+
+  void compile();
+  void execute(VkCommandBuffer command);
+
+  VkImage getImage(Handle h) const { return m_resources[h].image; }
+  VkImageView getImageView(Handle h) const { return m_resources[h].view; }
+  VkRenderPass getRenderPass(const RenderPassDesc& desc);
+  // インポートしたイメージのビューを作り直す前に呼ぶ.
+  void releaseFramebuffers();
+
+  // 最後の compile の結果をデバッグ出力へ表示する.
+  void report() const;
+
+private:
+  struct Access
+  {
+    Handle handle;
+    Usage usage;
+  };
+  struct Attachment
+  {
+    Handle handle;
+    VkAttachmentLoadOp loadOp;
+    VkClearValue clear;
+  };
+  struct Barrier
+  {
+    Handle handle;
+    State src, dst;
+  };
+  struct Pass
+  {
+    std::string name;
+    ExecuteFunc execute;
+    std::vector<Access> accesses;       // リソースごとに 1 つ. バリアの計算に使う.
+    std::vector<Handle> reads, writes;  // 不要なパスの判定に使う.
+    std::vector<Attachment> colors;
+    Attachment depth;
+    bool hasDepth;
+    bool depthReadOnly;
+    bool secondary;
+    bool sideEffect;
+    bool culled;
+    std::vector<Barrier> barriers;
+    VkRenderPass renderPass;
+  };
+  struct Resource
+  {
+    std::string name;
+    ImageDesc desc;
+    bool imported;
+    VkImage image;
+    VkImageView view;
+    State initial;
+    bool hasFinalUsage;
+    Usage finalUsage;
+    uint32_t firstPass, lastPass;   // 使用期間 (取り除かれたパスは含まない)
+    uint32_t transient;             // m_transients の番号
+  };
+  struct TransientImage
+  {
+    std::string name;
+    ImageDesc desc;
+    uint32_t firstPass, lastPass;
+    VkImage image;
+    VkImageView view;
+    VkDeviceSize offset, size;
+  };
+
+  void cullPasses();
+  void computeLifetimes();
+  bool allocateTransients();
+  void computeBarriers();
+  std::vector<State> simulate(bool record);
+  void recordBarriers(VkCommandBuffer command, const std::vector<Barrier>& barriers);
+  VkFramebuffer getFramebuffer(const Pass& pass, VkExtent2D extent);
+  bool isReadAfter(Handle h, uint32_t pass) const;
+  void release(std::function<void()> func);
+  void destroyTransients();
+  uint32_t getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropertyFlags requestProps) const;
+
+  VkDevice m_device;
+  VkPhysicalDeviceMemoryProperties m_memProps;
+  std::function<void(std::function<void()>)> m_releaseHandler;
+
+  std::vector<Pass> m_passes;
+  std::vector<Resource> m_resources;
+  std::vector<Barrier> m_finalBarriers;
+
+  // フレームをまたいで使いまわすもの
+  std::vector<TransientImage> m_transients;
+  VkDeviceMemory m_transientMemory;
+  VkDeviceSize m_transientMemorySize;
+  VkDeviceSize m_transientMemoryUnaliased;  // エイリアスしなかった場合の合計
+  std::map<std::vector<uint64_t>, VkRenderPass> m_renderPasses;
+  std::map<std::vector<uint64_t>, VkFramebuffer> m_framebuffers;
+};
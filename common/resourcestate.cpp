@@ -0,0 +1,335 @@
+﻿#include "resourcestate.h"
+
+using namespace std;
+
+namespace
+{
+  PFN_vkCmdPipelineBarrier2KHR s_vkCmdPipelineBarrier2KHR = nullptr;
+
+  const size_t NoPending = ~size_t(0);
+
+  const VkAccessFlags2KHR WriteAccessMask =
+    VK_ACCESS_2_SHADER_WRITE_BIT_KHR | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT_KHR |
+    VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR |
+    VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR | VK_ACCESS_2_HOST_WRITE_BIT_KHR | VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
+
+  // synchronization2 で追加された 32 ビットより上のビットを従来のフラグへ置き換える.
+  VkPipelineStageFlags ToLegacyStage(VkPipelineStageFlags2KHR stage)
+  {
+    auto result = VkPipelineStageFlags(stage & 0xFFFFFFFFull);
+    if (stage & (VK_PIPELINE_STAGE_2_COPY_BIT_KHR | VK_PIPELINE_STAGE_2_RESOLVE_BIT_KHR |
+      VK_PIPELINE_STAGE_2_BLIT_BIT_KHR | VK_PIPELINE_STAGE_2_CLEAR_BIT_KHR))
+    {
+      result |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    if (stage & (VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT_KHR | VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR))
+    {
+      result |= VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    }
+    if (stage & VK_PIPELINE_STAGE_2_PRE_RASTERIZATION_SHADERS_BIT_KHR)
+    {
+      result |= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_TESSELLATION_CONTROL_SHADER_BIT |
+        VK_PIPELINE_STAGE_TESSELLATION_EVALUATION_SHADER_BIT | VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT;
+    }
+    return result;
+  }
+  VkAccessFlags ToLegacyAccess(VkAccessFlags2KHR access)
+  {
+    auto result = VkAccessFlags(access & 0xFFFFFFFFull);
+    if (access & (VK_ACCESS_2_SHADER_SAMPLED_READ_BIT_KHR | VK_ACCESS_2_SHADER_STORAGE_READ_BIT_KHR))
+    {
+      result |= VK_ACCESS_SHADER_READ_BIT;
+    }
+    if (access & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT_KHR)
+    {
+      result |= VK_ACCESS_SHADER_WRITE_BIT;
+    }
+    return result;
+  }
+}
+
+void ResourceStateTracker::SetPipelineBarrier2(PFN_vkCmdPipelineBarrier2KHR func)
+{
+  s_vkCmdPipelineBarrier2KHR = func;
+}
+
+bool ResourceStateTracker::IsSynchronization2Enabled()
+{
+  return s_vkCmdPipelineBarrier2KHR != nullptr;
+}
+
+void ResourceStateTracker::RecordBarriers(VkCommandBuffer command,
+  const vector<ImageBarrier>& images, const vector<BufferBarrier>& buffers)
+{
+  if (images.empty() && buffers.empty())
+  {
+    return;
+  }
+  // 読み取りアクセスは可視化の対象にならないので、元側には書き込みだけを指定する.
+  if (s_vkCmdPipelineBarrier2KHR)
+  {
+    vector<VkImageMemoryBarrier2KHR> imbs;
+    for (const auto& v : images)
+    {
+      VkImageMemoryBarrier2KHR imb{};
+      imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+      imb.srcStageMask = v.src.stage;
+      imb.srcAccessMask = v.src.access & WriteAccessMask;
+      imb.dstStageMask = v.dst.stage;
+      imb.dstAccessMask = v.dst.access;
+      imb.oldLayout = v.src.layout;
+      imb.newLayout = v.dst.layout;
+      imb.srcQueueFamilyIndex = v.srcFamily;
+      imb.dstQueueFamilyIndex = v.dstFamily;
+      imb.image = v.image;
+      imb.subresourceRange = v.range;
+      imbs.push_back(imb);
+    }
+    vector<VkBufferMemoryBarrier2KHR> bmbs;
+    for (const auto& v : buffers)
+    {
+      VkBufferMemoryBarrier2KHR bmb{};
+      bmb.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2_KHR;
+      bmb.srcStageMask = v.src.stage;
+      bmb.srcAccessMask = v.src.access & WriteAccessMask;
+      bmb.dstStageMask = v.dst.stage;
+      bmb.dstAccessMask = v.dst.access;
+      bmb.srcQueueFamilyIndex = v.srcFamily;
+      bmb.dstQueueFamilyIndex = v.dstFamily;
+      bmb.buffer = v.buffer;
+      bmb.offset = 0;
+      bmb.size = VK_WHOLE_SIZE;
+      bmbs.push_back(bmb);
+    }
+    VkDependencyInfoKHR info{};
+    info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    info.imageMemoryBarrierCount = uint32_t(imbs.size());
+    info.pImageMemoryBarriers = imbs.data();
+    info.bufferMemoryBarrierCount = uint32_t(bmbs.size());
+    info.pBufferMemoryBarriers = bmbs.data();
+    s_vkCmdPipelineBarrier2KHR(command, &info);
+    return;
+  }
+
+  // 従来のバリアではステージが 1 組しか指定できないので、全バリアの分をまとめる.
+  VkPipelineStageFlags srcStage = 0, dstStage = 0;
+  vector<VkImageMemoryBarrier> imbs;
+  for (const auto& v : images)
+  {
+    VkImageMemoryBarrier imb{};
+    imb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imb.srcAccessMask = ToLegacyAccess(v.src.access & WriteAccessMask);
+    imb.dstAccessMask = ToLegacyAccess(v.dst.access);
+    imb.oldLayout = v.src.layout;
+    imb.newLayout = v.dst.layout;
+    imb.srcQueueFamilyIndex = v.srcFamily;
+    imb.dstQueueFamilyIndex = v.dstFamily;
+    imb.image = v.image;
+    imb.subresourceRange = v.range;
+    imbs.push_back(imb);
+    srcStage |= ToLegacyStage(v.src.stage);
+    dstStage |= ToLegacyStage(v.dst.stage);
+  }
+  vector<VkBufferMemoryBarrier> bmbs;
+  for (const auto& v : buffers)
+  {
+    VkBufferMemoryBarrier bmb{};
+    bmb.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bmb.srcAccessMask = ToLegacyAccess(v.src.access & WriteAccessMask);
+    bmb.dstAccessMask = ToLegacyAccess(v.dst.access);
+    bmb.srcQueueFamilyIndex = v.srcFamily;
+    bmb.dstQueueFamilyIndex = v.dstFamily;
+    bmb.buffer = v.buffer;
+    bmb.offset = 0;
+    bmb.size = VK_WHOLE_SIZE;
+    bmbs.push_back(bmb);
+    srcStage |= ToLegacyStage(v.src.stage);
+    dstStage |= ToLegacyStage(v.dst.stage);
+  }
+  if (srcStage == 0)
+  {
+    srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  }
+  if (dstStage == 0)
+  {
+    dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  }
+  vkCmdPipelineBarrier(command, srcStage, dstStage, 0,
+    0, nullptr,
+    uint32_t(bmbs.size()), bmbs.data(),
+    uint32_t(imbs.size()), imbs.data());
+}
+
+bool ResourceStateTracker::NeedsBarrier(const State& current, const State& next)
+{
+  return current.layout != next.layout ||
+    (current.access & WriteAccessMask) != 0 || (next.access & WriteAccessMask) != 0;
+}
+
+void ResourceStateTracker::addImage(VkImage image, const VkImageSubresourceRange& range, const State& state)
+{
+  m_images[image] = ImageEntry{ range, state, NoPending };
+}
+
+void ResourceStateTracker::addBuffer(VkBuffer buffer, const State& state)
+{
+  m_buffers[buffer] = BufferEntry{ state, NoPending };
+}
+
+void ResourceStateTracker::removeImage(VkImage image)
+{
+  m_images.erase(image);
+}
+
+void ResourceStateTracker::removeBuffer(VkBuffer buffer)
+{
+  m_buffers.erase(buffer);
+}
+
+void ResourceStateTracker::clear()
+{
+  m_images.clear();
+  m_buffers.clear();
+  m_imageBarriers.clear();
+  m_bufferBarriers.clear();
+}
+
+void ResourceStateTracker::useImage(VkImage image, const State& state)
+{
+  auto it = m_images.find(image);
+  if (it == m_images.end())
+  {
+    return;
+  }
+  auto& entry = it->second;
+  if (entry.pending != NoPending)
+  {
+    // flush の前に使い方が変わった. 間にこのイメージを使うコマンドはないので遷移先だけを置き換える.
+    m_imageBarriers[entry.pending].dst = state;
+    entry.state = state;
+    return;
+  }
+  if (!NeedsBarrier(entry.state, state))
+  {
+    entry.state.stage |= state.stage;
+    entry.state.access |= state.access;
+    return;
+  }
+  entry.pending = m_imageBarriers.size();
+  m_imageBarriers.push_back(ImageBarrier{
+    image, entry.range, entry.state, state, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED });
+  entry.state = state;
+}
+
+void ResourceStateTracker::useBuffer(VkBuffer buffer, const State& state)
+{
+  auto it = m_buffers.find(buffer);
+  if (it == m_buffers.end())
+  {
+    return;
+  }
+  auto& entry = it->second;
+  if (entry.pending != NoPending)
+  {
+    m_bufferBarriers[entry.pending].dst = state;
+    entry.state = state;
+    return;
+  }
+  if (!NeedsBarrier(entry.state, state))
+  {
+    entry.state.stage |= state.stage;
+    entry.state.access |= state.access;
+    return;
+  }
+  entry.pending = m_bufferBarriers.size();
+  m_bufferBarriers.push_back(BufferBarrier{
+    buffer, entry.state, state, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED });
+  entry.state = state;
+}
+
+void ResourceStateTracker::transferImage(VkImage image, uint32_t srcFamily, uint32_t dstFamily,
+  const State& state, ResourceStateTracker& acquirer)
+{
+  auto it = m_images.find(image);
+  if (it == m_images.end())
+  {
+    return;
+  }
+  auto& entry = it->second;
+
+  // 解放側. レイアウト遷移は解放・取得の両方に同じものを指定する.
+  State released = { 0, 0, state.layout };
+  ImageBarrier* release = nullptr;
+  if (entry.pending != NoPending)
+  {
+    release = &m_imageBarriers[entry.pending];
+    release->dst = released;
+  }
+  else
+  {
+    m_imageBarriers.push_back(ImageBarrier{ image, entry.range, entry.state, released, 0, 0 });
+    release = &m_imageBarriers.back();
+  }
+  release->srcFamily = srcFamily;
+  release->dstFamily = dstFamily;
+
+  // 取得側
+  State acquired = { 0, 0, release->src.layout };
+  acquirer.m_images[image] = ImageEntry{ entry.range, state, acquirer.m_imageBarriers.size() };
+  acquirer.m_imageBarriers.push_back(ImageBarrier{ image, entry.range, acquired, state, srcFamily, dstFamily });
+  m_images.erase(it);
+}
+
+void ResourceStateTracker::transferBuffer(VkBuffer buffer, uint32_t srcFamily, uint32_t dstFamily,
+  const State& state, ResourceStateTracker& acquirer)
+{
+  auto it = m_buffers.find(buffer);
+  if (it == m_buffers.end())
+  {
+    return;
+  }
+  auto& entry = it->second;
+
+  State released = { 0, 0, VK_IMAGE_LAYOUT_UNDEFINED };
+  BufferBarrier* release = nullptr;
+  if (entry.pending != NoPending)
+  {
+    release = &m_bufferBarriers[entry.pending];
+    release->dst = released;
+  }
+  else
+  {
+    m_bufferBarriers.push_back(BufferBarrier{ buffer, entry.state, released, 0, 0 });
+    release = &m_bufferBarriers.back();
+  }
+  release->srcFamily = srcFamily;
+  release->dstFamily = dstFamily;
+
+  State acquired = { 0, 0, VK_IMAGE_LAYOUT_UNDEFINED };
+  acquirer.m_buffers[buffer] = BufferEntry{ state, acquirer.m_bufferBarriers.size() };
+  acquirer.m_bufferBarriers.push_back(BufferBarrier{ buffer, acquired, state, srcFamily, dstFamily });
+  m_buffers.erase(it);
+}
+
+void ResourceStateTracker::flush(VkCommandBuffer command)
+{
+  RecordBarriers(command, m_imageBarriers, m_bufferBarriers);
+  for (const auto& v : m_imageBarriers)
+  {
+    auto it = m_images.find(v.image);
+    if (it != m_images.end())
+    {
+      it->second.pending = NoPending;
+    }
+  }
+  for (const auto& v : m_bufferBarriers)
+  {
+    auto it = m_buffers.find(v.buffer);
+    if (it != m_buffers.end())
+    {
+      it->second.pending = NoPending;
+    }
+  }
+  m_imageBarriers.clear();
+  m_bufferBarriers.clear();
+}
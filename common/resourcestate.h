@@ -0,0 +1,81 @@
+﻿#pragma once
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <map>
+
+// イメージ・バッファごとの状態 (レイアウト・ステージ・アクセス) を追跡し、
+// 使い方が変わるときに必要なバリアだけを積んでおき、flush で 1 回のバリアコマンドにまとめる.
+// VK_KHR_synchronization2 が使えるときはバリアごとに正確なステージを指定する vkCmdPipelineBarrier2KHR で、
+// 使えないときはステージをまとめた vkCmdPipelineBarrier で記録する.
+// 状態はコマンドバッファの記録順に対応するので、1 つのトラッカーは 1 つのキューでだけ使うこと.
+class ResourceStateTracker
+{
+public:
+  struct State
+  {
+    VkPipelineStageFlags2KHR stage;
+    VkAccessFlags2KHR access;
+    VkImageLayout layout;   // バッファでは使わない
+  };
+  struct ImageBarrier
+  {
+    VkImage image;
+    VkImageSubresourceRange range;
+    State src, dst;
+    uint32_t srcFamily, dstFamily;
+  };
+  struct BufferBarrier
+  {
+    VkBuffer buffer;
+    State src, dst;
+    uint32_t srcFamily, dstFamily;
+  };
+
+  // デバイスの生成後に vkCmdPipelineBarrier2KHR を設定する. nullptr なら従来のバリアを使う.
+  static void SetPipelineBarrier2(PFN_vkCmdPipelineBarrier2KHR func);
+  static bool IsSynchronization2Enabled();
+  // バリアをまとめて 1 回で記録する.
+  static void RecordBarriers(VkCommandBuffer command,
+    const std::vector<ImageBarrier>& images, const std::vector<BufferBarrier>& buffers);
+
+  // 追跡するリソースを現在の状態とともに登録する. 作成直後のイメージは VK_IMAGE_LAYOUT_UNDEFINED とする.
+  void addImage(VkImage image, const VkImageSubresourceRange& range, const State& state);
+  void addBuffer(VkBuffer buffer, const State& state);
+  void removeImage(VkImage image);
+  void removeBuffer(VkBuffer buffer);
+  void clear();
+
+  // 次の使い方を宣言する. 読み取り同士でレイアウトも同じなら、バリアは積まずに状態へ合成する.
+  // 積んだバリアは flush まで記録されないので、そのリソースを使うコマンドの前に flush すること.
+  void useImage(VkImage image, const State& state);
+  void useBuffer(VkBuffer buffer, const State& state);
+
+  // キューファミリー間で所有権を移す. 解放側のバリアをこのトラッカーに、取得側を acquirer に積み、
+  // リソースの追跡は acquirer に移る.
+  void transferImage(VkImage image, uint32_t srcFamily, uint32_t dstFamily,
+    const State& state, ResourceStateTracker& acquirer);
+  void transferBuffer(VkBuffer buffer, uint32_t srcFamily, uint32_t dstFamily,
+    const State& state, ResourceStateTracker& acquirer);
+
+  bool hasPendingBarriers() const { return !m_imageBarriers.empty() || !m_bufferBarriers.empty(); }
+  void flush(VkCommandBuffer command);
+
+private:
+  struct ImageEntry
+  {
+    VkImageSubresourceRange range;
+    State state;
+    size_t pending;   // 積んであるバリアの番号 (なければ ~0)
+  };
+  struct BufferEntry
+  {
+    State state;
+    size_t pending;
+  };
+  static bool NeedsBarrier(const State& current, const State& next);
+
+  std::map<VkImage, ImageEntry> m_images;
+  std::map<VkBuffer, BufferEntry> m_buffers;
+  std::vector<ImageBarrier> m_imageBarriers;
+  std::vector<BufferBarrier> m_bufferBarriers;
+};
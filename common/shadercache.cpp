@@ -0,0 +1,189 @@
+﻿#include "vkappbase.h"
+#include "shadercache.h"
+
+using namespace std;
+
+namespace
+{
+  const uint32_t SpirvMagic = 0x07230203;
+
+  // 読み取り専用でメモリマップしたファイル. スコープを抜けるとマップを解除する.
+  class MappedFile
+  {
+  public:
+    explicit MappedFile(const string& fileName)
+      : m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr), m_data(nullptr), m_size(0)
+    {
+      m_file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (m_file == INVALID_HANDLE_VALUE)
+      {
+        return;
+      }
+      // 空のファイルはマップできないので先に除く.
+      LARGE_INTEGER size;
+      if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+      {
+        return;
+      }
+      m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (m_mapping == nullptr)
+      {
+        return;
+      }
+      m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+      if (m_data != nullptr)
+      {
+        m_size = size_t(size.QuadPart);
+      }
+    }
+    ~MappedFile()
+    {
+      if (m_data != nullptr)
+      {
+        UnmapViewOfFile(m_data);
+      }
+      if (m_mapping != nullptr)
+      {
+        CloseHandle(m_mapping);
+      }
+      if (m_file != INVALID_HANDLE_VALUE)
+      {
+        CloseHandle(m_file);
+      }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // ビューの先頭はページ境界なので、uint32_t の配列としてそのまま読める.
+    const void* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+  private:
+    HANDLE m_file;
+    HANDLE m_mapping;
+    void*  m_data;
+    size_t m_size;
+  };
+
+  // FNV-1a (64bit)
+  uint64_t HashContents(const void* data, size_t size)
+  {
+    auto p = static_cast<const uint8_t*>(data);
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+      h ^= p[i];
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+
+  void CheckResult(VkResult result)
+  {
+    if (result != VK_SUCCESS)
+    {
+      DebugBreak();
+    }
+  }
+}
+
+ShaderModuleCache::ShaderModuleCache()
+  : m_device(VK_NULL_HANDLE)
+{
+}
+
+void ShaderModuleCache::initialize(VkDevice device)
+{
+  m_device = device;
+}
+
+void ShaderModuleCache::terminate()
+{
+  lock_guard<mutex> lock(m_mutex);
+  for (auto& v : m_modules)
+  {
+    vkDestroyShaderModule(m_device, v.second, nullptr);
+  }
+  m_modules.clear();
+  m_files.clear();
+}
+
+VkShaderModule ShaderModuleCache::getModule(const std::string& fileName)
+{
+  // 更新日時とサイズはファイルを開かずに得られる. 前回と同じならその時の内容のハッシュでモジュールを引く.
+  WIN32_FILE_ATTRIBUTE_DATA attr;
+  if (!GetFileAttributesExA(fileName.c_str(), GetFileExInfoStandard, &attr))
+  {
+    OutputDebugStringA("file not found.\n");
+    DebugBreak();
+    return VK_NULL_HANDLE;
+  }
+  FileStamp stamp;
+  stamp.lastWrite = uint64_t(attr.ftLastWriteTime.dwHighDateTime) << 32 | attr.ftLastWriteTime.dwLowDateTime;
+  stamp.size = uint64_t(attr.nFileSizeHigh) << 32 | attr.nFileSizeLow;
+  {
+    lock_guard<mutex> lock(m_mutex);
+    auto file = m_files.find(fileName);
+    if (file != m_files.end() && file->second.lastWrite == stamp.lastWrite && file->second.size == stamp.size)
+    {
+      auto it = m_modules.find(Key{ fileName, file->second.hash });
+      if (it != m_modules.end())
+      {
+        return it->second;
+      }
+    }
+  }
+
+  // 初めてのファイルか、書き換えられたファイル. 内容を読んでハッシュを求める.
+  MappedFile file(fileName);
+  if (file.data() == nullptr)
+  {
+    OutputDebugStringA("file not found.\n");
+    DebugBreak();
+    return VK_NULL_HANDLE;
+  }
+  auto code = static_cast<const uint32_t*>(file.data());
+  if (file.size() % sizeof(uint32_t) != 0 || code[0] != SpirvMagic)
+  {
+    OutputDebugStringA("invalid SPIR-V.\n");
+    DebugBreak();
+    return VK_NULL_HANDLE;
+  }
+  stamp.hash = HashContents(file.data(), file.size());
+
+  // 内容のハッシュもキーに含めるので、書き換わったファイルは別のモジュールになる. (元の内容に戻れば前のものを使う)
+  Key key{ fileName, stamp.hash };
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_files[fileName] = stamp;
+    auto it = m_modules.find(key);
+    if (it != m_modules.end())
+    {
+      return it->second;
+    }
+  }
+
+  // モジュールの作成はロックの外で行う. 他のスレッドが先に登録していたらそちらを使う.
+  VkShaderModule shaderModule;
+  VkShaderModuleCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  ci.pCode = code;
+  ci.codeSize = file.size();
+  auto result = vkCreateShaderModule(m_device, &ci, nullptr, &shaderModule);
+  CheckResult(result);
+
+  lock_guard<mutex> lock(m_mutex);
+  auto inserted = m_modules.emplace(key, shaderModule);
+  if (!inserted.second)
+  {
+    vkDestroyShaderModule(m_device, shaderModule, nullptr);
+  }
+  return inserted.first->second;
+}
+
+size_t ShaderModuleCache::getModuleCount() const
+{
+  lock_guard<mutex> lock(m_mutex);
+  return m_modules.size();
+}
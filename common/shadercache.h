@@ -0,0 +1,47 @@
+﻿#pragma once
+#include <vulkan/vulkan.h>
+#include <string>
+#include <map>
+#include <mutex>
+
+// シェーダーモジュールのキャッシュ.
+// .spv はメモリマップして読み、そのまま vkCreateShaderModule に渡す (ファイル内容のコピーはしない).
+// キーはファイル名と内容のハッシュ値で、同じ内容のモジュールは 1 度だけ作り、terminate まで保持する.
+// ファイルの更新日時とサイズが前回と同じなら、読み込まずに前回のハッシュ値で引く.
+// (後からパイプラインの組み合わせを追加で作る場合も作り直さずに済む)
+// 複数のスレッドから同時に呼んでよい.
+class ShaderModuleCache
+{
+public:
+  ShaderModuleCache();
+  void initialize(VkDevice device);
+  void terminate();
+
+  // ファイルが開けない・SPIR-V でない場合は VK_NULL_HANDLE を返す.
+  VkShaderModule getModule(const std::string& fileName);
+  size_t getModuleCount() const;
+
+private:
+  struct Key
+  {
+    std::string fileName;
+    uint64_t hash;
+    bool operator<(const Key& rhs) const
+    {
+      return hash != rhs.hash ? hash < rhs.hash : fileName < rhs.fileName;
+    }
+  };
+
+  // 最後に読んだときのファイルの状態と内容のハッシュ値
+  struct FileStamp
+  {
+    uint64_t lastWrite;
+    uint64_t size;
+    uint64_t hash;
+  };
+
+  VkDevice m_device;
+  mutable std::mutex m_mutex;
+  std::map<Key, VkShaderModule> m_modules;
+  std::map<std::string, FileStamp> m_files;
+};
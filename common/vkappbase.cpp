@@ -2,6 +2,13 @@
 #include <sstream>
 #include <algorithm>
 #include <array>
+#include <iomanip>
+#include <cstddef>
+#include <cstdlib>
+#include <cerrno>
+#include <shellapi.h>
+
+#pragma comment(lib, "shell32.lib")
 
 #define GetInstanceProcAddr(FuncName) \
   m_##FuncName = reinterpret_cast<PFN_##FuncName>(vkGetInstanceProcAddr(m_instance, #FuncName))
@@ -44,19 +51,273 @@ void VulkanAppBase::checkResult(VkResult result)
   }
 }
 
+VulkanAppBase::FeatureSet::FeatureSet()
+  : features(), vulkan12(), synchronization2(), presentId(), presentWait()
+{
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  vulkan12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  synchronization2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+  presentId.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+  presentWait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+  link([](const char*) { return true; });
+}
+
+VulkanAppBase::FeatureSet::FeatureSet(const FeatureSet& rhs)
+  : FeatureSet()
+{
+  *this = rhs;
+}
+
+VulkanAppBase::FeatureSet& VulkanAppBase::FeatureSet::operator=(const FeatureSet& rhs)
+{
+  // pNext の連結は自分自身のメンバを指すように保つ.
+  features.features = rhs.features.features;
+  vulkan12 = rhs.vulkan12;
+  synchronization2 = rhs.synchronization2;
+  presentId = rhs.presentId;
+  presentWait = rhs.presentWait;
+  link([](const char*) { return true; });
+  return *this;
+}
+
+void VulkanAppBase::FeatureSet::link(const function<bool(const char*)>& hasExtension)
+{
+  // Vulkan 1.2 の機能は常に連結し、拡張の構造体はその後ろに並べる.
+  features.pNext = &vulkan12;
+  void** next = &vulkan12.pNext;
+  if (hasExtension(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME))
+  {
+    *next = &synchronization2;
+    next = &synchronization2.pNext;
+  }
+  if (hasExtension(VK_KHR_PRESENT_ID_EXTENSION_NAME))
+  {
+    *next = &presentId;
+    next = &presentId.pNext;
+  }
+  if (hasExtension(VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+  {
+    *next = &presentWait;
+    next = &presentWait.pNext;
+  }
+  *next = nullptr;
+}
+
+vector<VkBool32*> VulkanAppBase::FeatureSet::bits()
+{
+  // どの構造体も (sType/pNext を除き) VkBool32 だけが並んでいる.
+  vector<VkBool32*> result;
+  auto p = reinterpret_cast<VkBool32*>(&features.features);
+  for (size_t i = 0; i < sizeof(VkPhysicalDeviceFeatures) / sizeof(VkBool32); ++i)
+  {
+    result.push_back(p + i);
+  }
+  // 構造体の末尾にはパディングがあるので、最後のメンバーの終わりまでに限る.
+  const auto first12 = offsetof(VkPhysicalDeviceVulkan12Features, samplerMirrorClampToEdge);
+  const auto last12 = offsetof(VkPhysicalDeviceVulkan12Features, subgroupBroadcastDynamicId) + sizeof(VkBool32);
+  p = reinterpret_cast<VkBool32*>(reinterpret_cast<uint8_t*>(&vulkan12) + first12);
+  for (size_t i = 0; i < (last12 - first12) / sizeof(VkBool32); ++i)
+  {
+    result.push_back(p + i);
+  }
+  result.push_back(&synchronization2.synchronization2);
+  result.push_back(&presentId.presentId);
+  result.push_back(&presentWait.presentWait);
+  return result;
+}
+
+bool VulkanAppBase::FeatureSet::contains(const FeatureSet& other) const
+{
+  auto mine = const_cast<FeatureSet*>(this)->bits();
+  auto theirs = const_cast<FeatureSet&>(other).bits();
+  for (size_t i = 0; i < mine.size(); ++i)
+  {
+    if (*theirs[i] && !*mine[i])
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t VulkanAppBase::FeatureSet::count() const
+{
+  auto mine = const_cast<FeatureSet*>(this)->bits();
+  return uint32_t(count_if(mine.begin(), mine.end(), [](VkBool32* v) { return *v != VK_FALSE; }));
+}
+
+static const char* GetPresentModeName(VkPresentModeKHR mode)
+{
+  switch (mode)
+  {
+  case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+  case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+  case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+  case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+  default: return "UNKNOWN";
+  }
+}
+
 VulkanAppBase::VulkanAppBase()
-  : m_presentMode(VK_PRESENT_MODE_FIFO_KHR)
+  : m_window(nullptr)
+  ,m_presentMode(VK_PRESENT_MODE_FIFO_KHR)
+  ,m_swapchainImageCount(0)
+  ,m_swapchain(VK_NULL_HANDLE)
+  ,m_swapchainOutOfDate(false)
+  ,m_depthFormat(VK_FORMAT_D32_SFLOAT)
+  ,m_recordSecondary(false)
+  ,m_framesInFlight(2)
+  ,m_staticCommandMode(false)
+  ,m_recordingThreads(0)
+  ,m_jobThreads(0)
+  ,m_frameTimelineValue(0)
+  ,m_uploadTimelineValue(0)
+  ,m_computeTimelineValue(0)
+  ,m_measureLatency(false)
+  ,m_latency()
+  ,m_vkWaitForPresentKHR(nullptr)
+  ,m_presentId(0)
+  ,m_presentWaiterExit(false)
   ,m_imageIndex(0)
+  ,m_frameIndex(0)
+{
+}
+
+void VulkanAppBase::setFramesInFlight(uint32_t count)
+{
+  // 1 フレームでは CPU と GPU が並行動作できず、多すぎても遅延が増えるだけなので 2～3 に制限する.
+  m_framesInFlight = (std::min)((std::max)(count, 2u), 3u);
+}
+
+void VulkanAppBase::setPresentMode(VkPresentModeKHR mode)
 {
+  m_presentMode = mode;
+}
+
+void VulkanAppBase::setSwapchainImageCount(uint32_t count)
+{
+  m_swapchainImageCount = count;
+}
+
+void VulkanAppBase::applyCommandLine(const wchar_t* cmdLine)
+{
+  if (cmdLine == nullptr || cmdLine[0] == L'\0')
+  {
+    return;
+  }
+  int argc = 0;
+  auto argv = CommandLineToArgvW(cmdLine, &argc);
+  if (argv == nullptr)
+  {
+    return;
+  }
+
+  for (int i = 0; i < argc; ++i)
+  {
+    wstring arg = argv[i];
+    if (arg.compare(0, 2, L"--") != 0)
+    {
+      continue;
+    }
+    auto pos = arg.find(L'=');
+    auto key = arg.substr(2, pos == wstring::npos ? wstring::npos : pos - 2);
+    auto value = pos == wstring::npos ? wstring() : arg.substr(pos + 1);
+
+    if (key == L"present")
+    {
+      if (value == L"fifo") { setPresentMode(VK_PRESENT_MODE_FIFO_KHR); }
+      else if (value == L"fifo_relaxed") { setPresentMode(VK_PRESENT_MODE_FIFO_RELAXED_KHR); }
+      else if (value == L"mailbox") { setPresentMode(VK_PRESENT_MODE_MAILBOX_KHR); }
+      else if (value == L"immediate") { setPresentMode(VK_PRESENT_MODE_IMMEDIATE_KHR); }
+      else { OutputDebugStringA("Unknown present mode.\n"); }
+    }
+    else if (key == L"images")
+    {
+      setSwapchainImageCount(uint32_t(_wtoi(value.c_str())));
+    }
+    else if (key == L"frames")
+    {
+      setFramesInFlight(uint32_t(_wtoi(value.c_str())));
+    }
+    else if (key == L"threads")
+    {
+      setRecordingThreads(uint32_t(_wtoi(value.c_str())));
+    }
+    else if (key == L"jobs")
+    {
+      setJobThreads(uint32_t(_wtoi(value.c_str())));
+    }
+    else if (key == L"measure-latency")
+    {
+      setLatencyMeasurement(true);
+    }
+    else if (key == L"device")
+    {
+      // デバイス名は ASCII なので単純に変換する.
+      string device;
+      for (auto c : value) { device.push_back(char(c)); }
+      setPhysicalDeviceOverride(device);
+    }
+    else if (!parseOption(key, value))
+    {
+      stringstream ss;
+      ss << "Unknown option: ";
+      for (auto c : arg) { ss << char(c); }
+      ss << endl;
+      OutputDebugStringA(ss.str().c_str());
+    }
+  }
+  LocalFree(argv);
 }
 
 void VulkanAppBase::initialize(GLFWwindow* window, const char* appName)
 {
+  m_window = window;
+  m_jobSystem.initialize(m_jobThreads);
+  // サイズ変更を通知してもらう (OUT_OF_DATE が返らない環境もあるため).
+  glfwSetWindowUserPointer(window, this);
+  glfwSetFramebufferSizeCallback(window, [](GLFWwindow* window, int, int) {
+    auto app = reinterpret_cast<VulkanAppBase*>(glfwGetWindowUserPointer(window));
+    app->m_swapchainOutOfDate = true;
+  });
+
+  // 使用する拡張と機能の宣言. 基本部分で必要なものを入れてから派生クラスに追加させる.
+  m_requirements = Requirements();
+  {
+    uint32_t count = 0;
+    auto glfwExtensions = glfwGetRequiredInstanceExtensions(&count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      m_requirements.instanceExtensions.push_back(glfwExtensions[i]);
+    }
+  }
+#ifdef _DEBUG
+  m_requirements.optionalInstanceExtensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
+#endif
+  m_requirements.deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  m_requirements.features.vulkan12.timelineSemaphore = VK_TRUE;
+  // 正確なステージを指定できるバリア. 使えなければ従来のバリアで代用する.
+  m_requirements.optionalDeviceExtensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+  m_requirements.optionalFeatures.synchronization2.synchronization2 = VK_TRUE;
+  if (m_measureLatency)
+  {
+    // 表示完了の時刻を得るための拡張. 使えなければ GPU の完了で近似する.
+    m_requirements.optionalDeviceExtensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+    m_requirements.optionalDeviceExtensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    m_requirements.optionalFeatures.presentId.presentId = VK_TRUE;
+    m_requirements.optionalFeatures.presentWait.presentWait = VK_TRUE;
+  }
+  declareRequirements(m_requirements);
+
   // Vulkan インスタンスの生成
   initializeInstance(appName);
+  // サーフェース生成 (表示可能なデバイス・キューの判定に使う)
+  glfwCreateWindowSurface(m_instance, window, nullptr, &m_surface);
   // 物理デバイスの選択
   selectPhysicalDevice();
-  m_graphicsQueueIndex = searchGraphicsQueueIndex();
+  m_graphicsQueueIndex = searchGraphicsQueueIndex(m_physDev);
+  m_transferQueueIndex = searchTransferQueueIndex();
+  m_computeQueueIndex = searchComputeQueueIndex();
 
 #ifdef _DEBUG
   // デバッグレポート関数のセット.
@@ -65,76 +326,91 @@ void VulkanAppBase::initialize(GLFWwindow* window, const char* appName)
 
   // 論理デバイスの生成
   createDevice();
+  m_pipelineCache.initialize(m_device);
   // コマンドプールの準備
   prepareCommandPool();
 
-  // サーフェース生成
-  glfwCreateWindowSurface(m_instance, window, nullptr, &m_surface);
   // サーフェースのフォーマット情報選択
   selectSurfaceFormat(VK_FORMAT_B8G8R8A8_UNORM);
   // サーフェースの能力値情報取得
   vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_physDev, m_surface, &m_surfaceCaps);
-  VkBool32 isSupport;
-  vkGetPhysicalDeviceSurfaceSupportKHR(m_physDev, m_graphicsQueueIndex, m_surface, &isSupport);
 
   // スワップチェイン生成
   createSwapchain(window);
-  // デプスバッファ生成
-  createDepthBuffer();
-  // スワップチェインイメージとデプスバッファへのImageViewを生成
+  // スワップチェインイメージへのImageViewを生成
   createViews();
 
-  // レンダーパスの生成
+  // レンダーパスの生成 (デプスバッファとフレームバッファは描画時にレンダーグラフが用意する)
   createRenderPass();
 
-  // フレームバッファの生成
-  createFramebuffer();
-
   // コマンドバッファの準備.
   prepareCommandBuffers();
 
   // 描画フレーム同期用
   prepareSemaphores();
+  prepareStaticCommands();
+  if (m_measureLatency && m_vkWaitForPresentKHR != nullptr)
+  {
+    m_presentWaiterExit = false;
+    m_presentWaiter = thread([this]() { presentWaitLoop(); });
+  }
 
   prepare();
 }
 
 void VulkanAppBase::terminate()
 {
+  // 最後の表示 (vkQueuePresentKHR) はタイムラインでは待てないので、デバイス全体の完了を待つ.
   vkDeviceWaitIdle(m_device);
+  processDeferredReleases();
+  if (m_presentWaiter.joinable())
+  {
+    {
+      lock_guard<mutex> lock(m_presentMutex);
+      m_presentWaiterExit = true;
+    }
+    m_presentCond.notify_all();
+    m_presentWaiter.join();
+  }
 
   cleanup();
+  processDeferredReleases();
+  m_pipelineCache.terminate();
   
-  vkFreeCommandBuffers(m_device, m_commandPool, uint32_t(m_commands.size()), m_commands.data());
-  m_commands.clear();
-
-  vkDestroyRenderPass(m_device, m_renderPass, nullptr);
-  for (auto& v : m_framebuffers)
+  for (auto& frame : m_frames)
   {
-    vkDestroyFramebuffer(m_device, v, nullptr);
+    vkFreeCommandBuffers(m_device, frame.commandPool, 1, &frame.command);
+    vkDestroyCommandPool(m_device, frame.commandPool, nullptr);
+    vkDestroySemaphore(m_device, frame.presentCompletedSem, nullptr);
+    for (size_t i = 0; i < frame.workerPools.size(); ++i)
+    {
+      vkFreeCommandBuffers(m_device, frame.workerPools[i], 1, &frame.workerCommands[i]);
+      vkDestroyCommandPool(m_device, frame.workerPools[i], nullptr);
+    }
   }
-  m_framebuffers.clear();
-
-  vkFreeMemory(m_device, m_depthBufferMemory, nullptr);
-  vkDestroyImage(m_device, m_depthBuffer, nullptr);
-  vkDestroyImageView(m_device, m_depthBufferView, nullptr);
-
-  for (auto& v : m_swapchainViews)
+  m_frames.clear();
+  if (!m_staticCommands.empty())
   {
-    vkDestroyImageView(m_device, v, nullptr);
+    vkFreeCommandBuffers(m_device, m_commandPool, uint32_t(m_staticCommands.size()), m_staticCommands.data());
+    m_staticCommands.clear();
   }
-  m_swapchainImages.clear();
+
+  m_renderGraph.terminate();
+  destroySwapchainResources();
   vkDestroySwapchainKHR(m_device, m_swapchain, nullptr);
 
-  for (auto& v : m_fences)
+  for (auto& v : m_renderCompletedSems)
   {
-    vkDestroyFence(m_device, v, nullptr);
+    vkDestroySemaphore(m_device, v, nullptr);
   }
-  m_fences.clear();
-  vkDestroySemaphore(m_device, m_presentCompletedSem, nullptr);
-  vkDestroySemaphore(m_device, m_renderCompletedSem, nullptr);
+  m_renderCompletedSems.clear();
+  vkDestroySemaphore(m_device, m_frameTimeline, nullptr);
+  vkDestroySemaphore(m_device, m_uploadTimeline, nullptr);
+  vkDestroySemaphore(m_device, m_computeTimeline, nullptr);
 
   vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+  vkDestroyCommandPool(m_device, m_transferCommandPool, nullptr);
+  vkDestroyCommandPool(m_device, m_computeCommandPool, nullptr);
 
   vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
   vkDestroyDevice(m_device, nullptr);
@@ -142,6 +418,7 @@ void VulkanAppBase::terminate()
   disableDebugReport();
 #endif
   vkDestroyInstance(m_instance,nullptr);
+  m_jobSystem.terminate();
 }
 
 
@@ -152,7 +429,7 @@ void VulkanAppBase::initializeInstance(const char* appName)
   appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
   appInfo.pApplicationName = appName;
   appInfo.pEngineName = appName;
-  appInfo.apiVersion = VK_API_VERSION_1_1;
+  appInfo.apiVersion = VK_API_VERSION_1_2;
   appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
 
   // 拡張情報の取得.
@@ -162,12 +439,33 @@ void VulkanAppBase::initializeInstance(const char* appName)
     vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
     props.resize(count);
     vkEnumerateInstanceExtensionProperties(nullptr, &count, props.data());
+  }
+  auto isAvailable = [&props](const string& name) {
+    return any_of(props.begin(), props.end(), [&name](const VkExtensionProperties& v) { return name == v.extensionName; });
+  };
 
-    for (const auto& v : props)
+  // 宣言されたものだけを有効化する.
+  m_enabledInstanceExtensions.clear();
+  for (const auto& v : m_requirements.instanceExtensions)
+  {
+    if (!isAvailable(v))
+    {
+      OutputDebugStringA(("Required instance extension is not available: " + v + "\n").c_str());
+      DebugBreak();
+    }
+    m_enabledInstanceExtensions.push_back(v);
+  }
+  for (const auto& v : m_requirements.optionalInstanceExtensions)
+  {
+    if (isAvailable(v))
     {
-      extensions.push_back(v.extensionName);
+      m_enabledInstanceExtensions.push_back(v);
     }
   }
+  for (const auto& v : m_enabledInstanceExtensions)
+  {
+    extensions.push_back(v.c_str());
+  }
 
   VkInstanceCreateInfo ci{};
   ci.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO; 
@@ -193,37 +491,268 @@ void VulkanAppBase::selectPhysicalDevice()
   vector<VkPhysicalDevice> physDevs(devCount);
   vkEnumeratePhysicalDevices(m_instance, &devCount, physDevs.data());
 
-  // 最初のデバイスを使用する
-  m_physDev = physDevs[0];
+  // 指定があればそれを、なければ最もスコアの高いデバイスを使用する.
+  m_physDev = VK_NULL_HANDLE;
+  VkPhysicalDevice bestDevice = VK_NULL_HANDLE;
+  int64_t bestScore = -1;
+  for (uint32_t i = 0; i < devCount; ++i)
+  {
+    auto score = scorePhysicalDevice(physDevs[i]);
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physDevs[i], &props);
+    stringstream ss;
+    ss << "Device[" << i << "] " << props.deviceName << " score=" << score << endl;
+    OutputDebugStringA(ss.str().c_str());
+
+    if (score < 0)
+    {
+      continue;
+    }
+    if (!m_deviceOverride.empty() && m_physDev == VK_NULL_HANDLE && matchPhysicalDevice(physDevs[i], i, m_deviceOverride))
+    {
+      m_physDev = physDevs[i];
+    }
+    if (score > bestScore)
+    {
+      bestDevice = physDevs[i];
+      bestScore = score;
+    }
+  }
+  if (bestDevice == VK_NULL_HANDLE)
+  {
+    // 使えるデバイスがなければ続行できない.
+    OutputDebugStringA("No suitable physical device.\n");
+    DebugBreak();
+    abort();
+  }
+  if (m_physDev == VK_NULL_HANDLE)
+  {
+    // 指定の誤りで止まらないよう、自動選択のデバイスで続ける.
+    if (!m_deviceOverride.empty())
+    {
+      stringstream ss;
+      ss << "Device \"" << m_deviceOverride << "\" is not found or not suitable. Use the best scored device." << endl;
+      OutputDebugStringA(ss.str().c_str());
+    }
+    m_physDev = bestDevice;
+  }
+
   // メモリプロパティを取得しておく
   vkGetPhysicalDeviceMemoryProperties(m_physDev, &m_physMemProps);
+  vkGetPhysicalDeviceProperties(m_physDev, &m_physDevProps);
+
+  // 機能のサポート状況を取得しておく
+  m_supportedFeatures = queryFeatures(m_physDev);
+
+  // 計測結果と照合できるよう、選択したデバイスは必ず出力する.
+  VkDeviceSize localHeapSize = 0;
+  for (uint32_t i = 0; i < m_physMemProps.memoryHeapCount; ++i)
+  {
+    if (m_physMemProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+    {
+      localHeapSize += m_physMemProps.memoryHeaps[i].size;
+    }
+  }
+  stringstream ss;
+  ss << "Selected device: " << m_physDevProps.deviceName
+    << " (vendor=0x" << hex << m_physDevProps.vendorID
+    << " device=0x" << m_physDevProps.deviceID
+    << " driver=0x" << m_physDevProps.driverVersion << dec
+    << " local=" << (localHeapSize >> 20) << "MB)" << endl;
+  OutputDebugStringA(ss.str().c_str());
+}
+
+int64_t VulkanAppBase::scorePhysicalDevice(VkPhysicalDevice physDev) const
+{
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physDev, &props);
+
+  // 必須条件: Vulkan 1.2・要求された拡張と機能・表示可能なグラフィックスキュー
+  if (props.apiVersion < VK_API_VERSION_1_2)
+  {
+    return -1;
+  }
+  uint32_t count = 0;
+  vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, nullptr);
+  vector<VkExtensionProperties> extProps(count);
+  vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, extProps.data());
+  for (const auto& name : m_requirements.deviceExtensions)
+  {
+    auto found = any_of(extProps.begin(), extProps.end(), [&name](const VkExtensionProperties& v) {
+      return name == v.extensionName;
+    });
+    if (!found)
+    {
+      return -1;
+    }
+  }
+  if (!queryFeatures(physDev).contains(m_requirements.features) ||
+    searchGraphicsQueueIndex(physDev) == ~0u)
+  {
+    return -1;
+  }
+
+  // デバイスの種類を最優先し、同じ種類ならデバイスローカルのメモリが多いものを選ぶ.
+  int64_t typeScore = 0;
+  switch (props.deviceType)
+  {
+  case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: typeScore = 4; break;
+  case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: typeScore = 3; break;
+  case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: typeScore = 2; break;
+  case VK_PHYSICAL_DEVICE_TYPE_CPU: typeScore = 0; break;  // ソフトウェアラスタライザ
+  default: typeScore = 1; break;
+  }
+
+  VkPhysicalDeviceMemoryProperties memProps;
+  vkGetPhysicalDeviceMemoryProperties(physDev, &memProps);
+  int64_t localHeapMB = 0;
+  for (uint32_t i = 0; i < memProps.memoryHeapCount; ++i)
+  {
+    if (memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+    {
+      localHeapMB += int64_t(memProps.memoryHeaps[i].size >> 20);
+    }
+  }
+  return typeScore * 100000000 + localHeapMB;
 }
 
-uint32_t VulkanAppBase::searchGraphicsQueueIndex()
+bool VulkanAppBase::matchPhysicalDevice(VkPhysicalDevice physDev, uint32_t index, const string& key) const
+{
+  // 番号. 桁が多すぎて範囲外になる指定はどのデバイスにも一致しない.
+  if (all_of(key.begin(), key.end(), [](char c) { return isdigit(uint8_t(c)) != 0; }))
+  {
+    errno = 0;
+    auto value = strtoull(key.c_str(), nullptr, 10);
+    return errno != ERANGE && value == index;
+  }
+
+  VkPhysicalDeviceIDProperties idProps{};
+  idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+  VkPhysicalDeviceProperties2 props2{};
+  props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  props2.pNext = &idProps;
+  vkGetPhysicalDeviceProperties2(physDev, &props2);
+
+  // UUID (16 進数 32 桁. 区切りの '-' は無視する)
+  string hexKey;
+  for (auto c : key)
+  {
+    if (c != '-') { hexKey.push_back(char(tolower(uint8_t(c)))); }
+  }
+  if (hexKey.size() == VK_UUID_SIZE * 2 && all_of(hexKey.begin(), hexKey.end(), [](char c) { return isxdigit(uint8_t(c)) != 0; }))
+  {
+    stringstream ss;
+    for (auto v : idProps.deviceUUID)
+    {
+      ss << hex << setw(2) << setfill('0') << uint32_t(v);
+    }
+    return ss.str() == hexKey;
+  }
+
+  // 名前の一部
+  return string(props2.properties.deviceName).find(key) != string::npos;
+}
+
+VulkanAppBase::FeatureSet VulkanAppBase::queryFeatures(VkPhysicalDevice physDev) const
+{
+  FeatureSet result;
+  // 拡張に対応していないデバイスには、その拡張の機能構造体を渡さない.
+  uint32_t count = 0;
+  vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, nullptr);
+  vector<VkExtensionProperties> props(count);
+  vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, props.data());
+  result.link([&props](const char* name) {
+    return any_of(props.begin(), props.end(), [name](const VkExtensionProperties& v) {
+      return string(v.extensionName) == name;
+    });
+  });
+  vkGetPhysicalDeviceFeatures2(physDev, &result.features);
+  result.link([](const char*) { return true; });
+  return result;
+}
+
+uint32_t VulkanAppBase::searchGraphicsQueueIndex(VkPhysicalDevice physDev) const
 {
   uint32_t propCount;
-  vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, nullptr);
+  vkGetPhysicalDeviceQueueFamilyProperties(physDev, &propCount, nullptr);
   vector<VkQueueFamilyProperties> props(propCount);
-  vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, props.data());
+  vkGetPhysicalDeviceQueueFamilyProperties(physDev, &propCount, props.data());
 
+  // Present も同じキューで行うため、サーフェースへの表示に対応したものに限る.
   uint32_t graphicsQueue = ~0u;
   for (uint32_t i = 0; i < propCount; ++i)
   {
-    if (props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+    VkBool32 isSupport = VK_FALSE;
+    vkGetPhysicalDeviceSurfaceSupportKHR(physDev, i, m_surface, &isSupport);
+    if ((props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) && isSupport)
     {
       graphicsQueue = i; break;
     }
   }
   return graphicsQueue;
 }
+
+uint32_t VulkanAppBase::searchTransferQueueIndex()
+{
+  uint32_t propCount;
+  vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, nullptr);
+  vector<VkQueueFamilyProperties> props(propCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, props.data());
+
+  // 転送のみ (グラフィックス・コンピュート不可) のファミリーは DMA エンジンに対応していることが多い.
+  for (uint32_t i = 0; i < propCount; ++i)
+  {
+    auto flags = props[i].queueFlags;
+    if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+      (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == 0)
+    {
+      return i;
+    }
+  }
+  // 見つからなければグラフィックス用のキューで転送する.
+  return m_graphicsQueueIndex;
+}
+
+uint32_t VulkanAppBase::searchComputeQueueIndex()
+{
+  uint32_t propCount;
+  vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, nullptr);
+  vector<VkQueueFamilyProperties> props(propCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, props.data());
+
+  // グラフィックス不可のコンピュートファミリーは描画と並行して実行できる.
+  for (uint32_t i = 0; i < propCount; ++i)
+  {
+    auto flags = props[i].queueFlags;
+    if ((flags & VK_QUEUE_COMPUTE_BIT) && (flags & VK_QUEUE_GRAPHICS_BIT) == 0)
+    {
+      return i;
+    }
+  }
+  return m_graphicsQueueIndex;
+}
 void VulkanAppBase::createDevice()
 {
   const float defaultQueuePriority(1.0f);
-  VkDeviceQueueCreateInfo devQueueCI{};
-  devQueueCI.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  devQueueCI.queueFamilyIndex = m_graphicsQueueIndex;
-  devQueueCI.queueCount = 1;
-  devQueueCI.pQueuePriorities = &defaultQueuePriority;
+  vector<VkDeviceQueueCreateInfo> devQueueCIs;
+  {
+    VkDeviceQueueCreateInfo devQueueCI{};
+    devQueueCI.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    devQueueCI.queueFamilyIndex = m_graphicsQueueIndex;
+    devQueueCI.queueCount = 1;
+    devQueueCI.pQueuePriorities = &defaultQueuePriority;
+    devQueueCIs.push_back(devQueueCI);
+    if (hasDedicatedTransferQueue())
+    {
+      devQueueCI.queueFamilyIndex = m_transferQueueIndex;
+      devQueueCIs.push_back(devQueueCI);
+    }
+    if (hasAsyncComputeQueue())
+    {
+      devQueueCI.queueFamilyIndex = m_computeQueueIndex;
+      devQueueCIs.push_back(devQueueCI);
+    }
+  }
 
 
   vector<VkExtensionProperties> devExtProps;
@@ -235,15 +764,60 @@ void VulkanAppBase::createDevice()
     vkEnumerateDeviceExtensionProperties(m_physDev, nullptr, &count, devExtProps.data());
   }
 
+  // 拡張は宣言されたもののみ有効化する. (必須のものはデバイス選択時に確認済み)
+  m_enabledDeviceExtensions = m_requirements.deviceExtensions;
+  for (const auto& name : m_requirements.optionalDeviceExtensions)
+  {
+    auto found = any_of(devExtProps.begin(), devExtProps.end(), [&name](const VkExtensionProperties& v) {
+      return name == v.extensionName;
+    });
+    if (found)
+    {
+      m_enabledDeviceExtensions.push_back(name);
+    }
+  }
   vector<const char*> extensions;
-  for (const auto& v : devExtProps)
+  for (const auto& v : m_enabledDeviceExtensions)
+  {
+    extensions.push_back(v.c_str());
+  }
+
+  // 機能も必須のものと、任意のもののうち対応しているものだけを有効化する.
+  m_enabledFeatures = m_requirements.features;
+  {
+    auto enabled = m_enabledFeatures.bits();
+    auto optional = m_requirements.optionalFeatures.bits();
+    auto supported = m_supportedFeatures.bits();
+    for (size_t i = 0; i < enabled.size(); ++i)
+    {
+      if (*optional[i] && *supported[i])
+      {
+        *enabled[i] = VK_TRUE;
+      }
+    }
+  }
+
+  // 有効化しなかった拡張の機能は外す.
+  if (!isDeviceExtensionEnabled(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME))
+  {
+    m_enabledFeatures.synchronization2.synchronization2 = VK_FALSE;
+  }
+  if (!isDeviceExtensionEnabled(VK_KHR_PRESENT_ID_EXTENSION_NAME))
   {
-    extensions.push_back(v.extensionName);
+    m_enabledFeatures.presentId.presentId = VK_FALSE;
   }
+  if (!isDeviceExtensionEnabled(VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+  {
+    m_enabledFeatures.presentWait.presentWait = VK_FALSE;
+  }
+  auto features = m_enabledFeatures;
+  features.link([this](const char* name) { return isDeviceExtensionEnabled(name); });
+
   VkDeviceCreateInfo ci{};
   ci.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  ci.pQueueCreateInfos = &devQueueCI;
-  ci.queueCreateInfoCount = 1;
+  ci.pNext = &features.features;
+  ci.pQueueCreateInfos = devQueueCIs.data();
+  ci.queueCreateInfoCount = uint32_t(devQueueCIs.size());
   ci.ppEnabledExtensionNames = extensions.data();
   ci.enabledExtensionCount = uint32_t(extensions.size());
 
@@ -252,6 +826,48 @@ void VulkanAppBase::createDevice()
 
   // デバイスキューの取得
   vkGetDeviceQueue(m_device, m_graphicsQueueIndex, 0, &m_deviceQueue);
+  vkGetDeviceQueue(m_device, m_transferQueueIndex, 0, &m_transferQueue);
+  vkGetDeviceQueue(m_device, m_computeQueueIndex, 0, &m_computeQueue);
+
+  // バリアの記録方法の選択
+  PFN_vkCmdPipelineBarrier2KHR barrier2 = nullptr;
+  if (m_enabledFeatures.synchronization2.synchronization2)
+  {
+    barrier2 = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(vkGetDeviceProcAddr(m_device, "vkCmdPipelineBarrier2KHR"));
+  }
+  ResourceStateTracker::SetPipelineBarrier2(barrier2);
+
+  // 表示完了の待ち. 表示要求に ID を付けられる場合だけ使う.
+  m_vkWaitForPresentKHR = nullptr;
+  if (m_enabledFeatures.presentId.presentId && m_enabledFeatures.presentWait.presentWait)
+  {
+    m_vkWaitForPresentKHR = reinterpret_cast<PFN_vkWaitForPresentKHR>(vkGetDeviceProcAddr(m_device, "vkWaitForPresentKHR"));
+  }
+
+  reportEnabledExtensionsAndFeatures();
+}
+
+void VulkanAppBase::reportEnabledExtensionsAndFeatures() const
+{
+  stringstream ss;
+  ss << "Instance extensions:";
+  for (const auto& v : m_enabledInstanceExtensions) { ss << " " << v; }
+  ss << endl << "Device extensions:";
+  for (const auto& v : m_enabledDeviceExtensions) { ss << " " << v; }
+  ss << endl << "Features: required=" << m_requirements.features.count()
+    << " optional=" << m_requirements.optionalFeatures.count()
+    << " enabled=" << m_enabledFeatures.count() << endl;
+  OutputDebugStringA(ss.str().c_str());
+}
+
+bool VulkanAppBase::isInstanceExtensionEnabled(const char* name) const
+{
+  return find(m_enabledInstanceExtensions.begin(), m_enabledInstanceExtensions.end(), name) != m_enabledInstanceExtensions.end();
+}
+
+bool VulkanAppBase::isDeviceExtensionEnabled(const char* name) const
+{
+  return find(m_enabledDeviceExtensions.begin(), m_enabledDeviceExtensions.end(), name) != m_enabledDeviceExtensions.end();
 }
 
 void VulkanAppBase::prepareCommandPool()
@@ -259,9 +875,22 @@ void VulkanAppBase::prepareCommandPool()
   VkCommandPoolCreateInfo ci{};
   ci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
   ci.queueFamilyIndex = m_graphicsQueueIndex;
-  ci.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  // 静的コマンド用. 個別のリセットはせず、記録しなおすときは解放して確保しなおす.
+  ci.flags = 0;
   auto result = vkCreateCommandPool(m_device, &ci, nullptr, &m_commandPool);
   checkResult(result);
+
+  // 転送用 (転送のコマンドバッファは 1 度きりなので TRANSIENT)
+  ci.queueFamilyIndex = m_transferQueueIndex;
+  ci.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  result = vkCreateCommandPool(m_device, &ci, nullptr, &m_transferCommandPool);
+  checkResult(result);
+
+  // コンピュート用
+  ci.queueFamilyIndex = m_computeQueueIndex;
+  ci.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  result = vkCreateCommandPool(m_device, &ci, nullptr, &m_computeCommandPool);
+  checkResult(result);
 }
 
 void VulkanAppBase::selectSurfaceFormat(VkFormat format)
@@ -283,12 +912,36 @@ void VulkanAppBase::selectSurfaceFormat(VkFormat format)
 
 void VulkanAppBase::createSwapchain(GLFWwindow* window)
 {
-  auto imageCount = (std::max)(2u, m_surfaceCaps.minImageCount);
-  auto extent = m_surfaceCaps.currentExtent;
-  if (extent.width == ~0u)
+  // 表示モードはサーフェースが対応しているものだけ使用できる. 非対応なら必ず使える FIFO にする.
+  uint32_t modeCount = 0;
+  vkGetPhysicalDeviceSurfacePresentModesKHR(m_physDev, m_surface, &modeCount, nullptr);
+  vector<VkPresentModeKHR> modes(modeCount);
+  vkGetPhysicalDeviceSurfacePresentModesKHR(m_physDev, m_surface, &modeCount, modes.data());
+  if (find(modes.begin(), modes.end(), m_presentMode) == modes.end())
   {
-    // 値が無効なのでウィンドウサイズを使用する.
-    int width, height;
+    stringstream ss;
+    ss << "Present mode " << GetPresentModeName(m_presentMode) << " is not supported. Use FIFO." << endl;
+    OutputDebugStringA(ss.str().c_str());
+    m_presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  }
+
+  // イメージ数はサーフェースの対応範囲に収める (maxImageCount が 0 なら上限なし).
+  auto imageCount = m_swapchainImageCount;
+  if (imageCount == 0)
+  {
+    imageCount = (std::max)(2u, m_surfaceCaps.minImageCount);
+  }
+  imageCount = (std::max)(imageCount, m_surfaceCaps.minImageCount);
+  if (m_surfaceCaps.maxImageCount > 0)
+  {
+    imageCount = (std::min)(imageCount, m_surfaceCaps.maxImageCount);
+  }
+
+  auto extent = m_surfaceCaps.currentExtent;
+  if (extent.width == ~0u)
+  {
+    // 値が無効なのでウィンドウサイズを使用する.
+    int width, height;
     glfwGetWindowSize(window, &width, &height);
     extent.width = uint32_t(width);
     extent.height = uint32_t(height);
@@ -307,40 +960,21 @@ void VulkanAppBase::createSwapchain(GLFWwindow* window)
   ci.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
   ci.queueFamilyIndexCount = 0;
   ci.presentMode = m_presentMode;
-  ci.oldSwapchain = VK_NULL_HANDLE;
+  ci.oldSwapchain = m_swapchain;  // 作り直しの場合は古いスワップチェインを渡す
   ci.clipped = VK_TRUE;
   ci.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 
   auto result = vkCreateSwapchainKHR(m_device, &ci, nullptr, &m_swapchain);
   checkResult(result);
   m_swapchainExtent = extent;
-}
-void VulkanAppBase::createDepthBuffer()
-{
-  VkImageCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-  ci.imageType = VK_IMAGE_TYPE_2D;
-  ci.format = VK_FORMAT_D32_SFLOAT;
-  ci.extent.width = m_swapchainExtent.width;
-  ci.extent.height = m_swapchainExtent.height;
-  ci.extent.depth = 1;
-  ci.mipLevels = 1;
-  ci.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-  ci.samples = VK_SAMPLE_COUNT_1_BIT;
-  ci.arrayLayers = 1;
-  auto result = vkCreateImage(m_device, &ci, nullptr, &m_depthBuffer);
-  checkResult(result);
 
-  VkMemoryRequirements reqs;
-  vkGetImageMemoryRequirements(m_device, m_depthBuffer, &reqs);
-  VkMemoryAllocateInfo ai{};
-  ai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  ai.allocationSize = reqs.size;
-  ai.memoryTypeIndex = getMemoryTypeIndex(reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-  vkAllocateMemory(m_device, &ai, nullptr, &m_depthBufferMemory);
-  vkBindImageMemory(m_device, m_depthBuffer, m_depthBufferMemory, 0);
+  // 実際に作成されたイメージ数は要求より多いことがある.
+  uint32_t actualCount = 0;
+  vkGetSwapchainImagesKHR(m_device, m_swapchain, &actualCount, nullptr);
+  stringstream ss;
+  ss << "Swapchain: present=" << GetPresentModeName(m_presentMode) << " images=" << actualCount << endl;
+  OutputDebugStringA(ss.str().c_str());
 }
-
 void VulkanAppBase::createViews()
 {
   uint32_t imageCount;
@@ -365,129 +999,392 @@ void VulkanAppBase::createViews()
     auto result = vkCreateImageView(m_device, &ci, nullptr, &m_swapchainViews[i]);
     checkResult(result);
   }
+}
+
+void VulkanAppBase::createRenderPass()
+{
+  m_renderGraph.initialize(m_device, m_physDev);
+  // グラフが作り直すイメージやフレームバッファは、送信済みのフレームが終わってから破棄する.
+  m_renderGraph.setReleaseHandler([this](function<void()> release) {
+    deferRelease(m_frameTimeline, m_frameTimelineValue, release);
+  });
+
+  // メインパスと同じ形を指定するので、描画時にグラフが使うものと同じレンダーパスが返る.
+  // デプスバッファは後で読まれないので書き戻さない.
+  RenderGraph::RenderPassDesc desc{};
+  desc.colors.push_back({
+    m_surfaceFormat.format, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_STORE, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+  });
+  desc.depth = {
+    m_depthFormat, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_STORE_OP_DONT_CARE, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+  };
+  m_renderPass = m_renderGraph.getRenderPass(desc);
+}
 
-  // for depthbuffer
+void VulkanAppBase::destroySwapchainResources()
+{
+  // スワップチェインのビューを参照するフレームバッファを先に破棄する.
+  m_renderGraph.releaseFramebuffers();
+
+  for (auto& v : m_swapchainViews)
   {
-    VkImageViewCreateInfo ci{};
-    ci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    ci.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    ci.format = VK_FORMAT_D32_SFLOAT;
-    ci.components = {
-      VK_COMPONENT_SWIZZLE_R,
-      VK_COMPONENT_SWIZZLE_G,
-      VK_COMPONENT_SWIZZLE_B,
-      VK_COMPONENT_SWIZZLE_A,
-    };
-    ci.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
-    ci.image = m_depthBuffer;
-    auto result = vkCreateImageView(m_device, &ci, nullptr, &m_depthBufferView);
+    vkDestroyImageView(m_device, v, nullptr);
+  }
+  m_swapchainViews.clear();
+  m_swapchainImages.clear();
+}
+
+bool VulkanAppBase::recreateSwapchain()
+{
+  // 最小化中はサイズが 0 になり、スワップチェインを作れない.
+  int width = 0, height = 0;
+  glfwGetFramebufferSize(m_window, &width, &height);
+  if (width == 0 || height == 0)
+  {
+    return false;
+  }
+
+  // 古いイメージを使う描画と表示の完了を待つ. (デバイス全体ではなく描画・表示のキューのみ)
+  // 表示は描画完了のセマフォを待っているので、キューが空になるまでスワップチェインもセマフォも触れない.
+  waitTimeline(m_frameTimeline, m_frameTimelineValue);
+  vkQueueWaitIdle(m_deviceQueue);
+  waitPresentWaiterIdle();
+
+  // レンダーパスとパイプラインはそのまま使い、サイズに依存するものだけ作り直す.
+  destroySwapchainResources();
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_physDev, m_surface, &m_surfaceCaps);
+  auto oldSwapchain = m_swapchain;
+  createSwapchain(m_window);
+  vkDestroySwapchainKHR(m_device, oldSwapchain, nullptr);
+  // デプスバッファはサイズの変化を見てレンダーグラフが作り直す.
+  createViews();
+
+  // イメージ数が増えた場合は描画完了通知用のセマフォを追加する.
+  VkSemaphoreCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  while (m_renderCompletedSems.size() < m_swapchainImages.size())
+  {
+    VkSemaphore semaphore;
+    vkCreateSemaphore(m_device, &ci, nullptr, &semaphore);
+    m_renderCompletedSems.push_back(semaphore);
+  }
+
+  prepareStaticCommands();
+  onSwapchainRecreated();
+
+  m_swapchainOutOfDate = false;
+  return true;
+}
+
+void VulkanAppBase::prepareStaticCommands()
+{
+  if (!m_staticCommandMode)
+  {
+    return;
+  }
+  // イメージ数が変わることがあるので、不足分を確保して全部を記録しなおす.
+  auto imageCount = uint32_t(m_swapchainImages.size());
+  if (m_staticCommands.size() < imageCount)
+  {
+    VkCommandBufferAllocateInfo ai{};
+    ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    ai.commandPool = m_commandPool;
+    ai.commandBufferCount = imageCount - uint32_t(m_staticCommands.size());
+    ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    vector<VkCommandBuffer> commands(ai.commandBufferCount);
+    auto result = vkAllocateCommandBuffers(m_device, &ai, commands.data());
     checkResult(result);
+    m_staticCommands.insert(m_staticCommands.end(), commands.begin(), commands.end());
+    m_staticCommandUse.resize(imageCount, 0);
   }
+  markCommandsDirty();
 }
 
-void VulkanAppBase::createRenderPass()
+void VulkanAppBase::markCommandsDirty()
 {
-  VkRenderPassCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-
-  array<VkAttachmentDescription, 2> attachments;
-  auto& colorTarget = attachments[0];
-  auto& depthTarget = attachments[1];
-
-  colorTarget = VkAttachmentDescription{};
-  colorTarget.format = m_surfaceFormat.format;
-  colorTarget.samples = VK_SAMPLE_COUNT_1_BIT;
-  colorTarget.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  colorTarget.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  colorTarget.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  colorTarget.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  colorTarget.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorTarget.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-  depthTarget = VkAttachmentDescription{};
-  depthTarget.format = VK_FORMAT_D32_SFLOAT;
-  depthTarget.samples = VK_SAMPLE_COUNT_1_BIT;
-  depthTarget.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depthTarget.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  depthTarget.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  depthTarget.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depthTarget.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depthTarget.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-  VkAttachmentReference colorReference{}, depthReference{};
-  colorReference.attachment = 0;
-  colorReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-  depthReference.attachment = 1;
-  depthReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-  VkSubpassDescription subpassDesc{};
-  subpassDesc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpassDesc.colorAttachmentCount = 1;
-  subpassDesc.pColorAttachments = &colorReference;
-  subpassDesc.pDepthStencilAttachment = &depthReference;
-
-  ci.attachmentCount = uint32_t(attachments.size());
-  ci.pAttachments = attachments.data();
-  ci.subpassCount = 1;
-  ci.pSubpasses = &subpassDesc;
-
-  auto result = vkCreateRenderPass(m_device, &ci, nullptr, &m_renderPass);
-  checkResult(result);
+  m_staticCommandDirty.assign(m_staticCommands.size(), true);
 }
 
-void VulkanAppBase::createFramebuffer()
+void VulkanAppBase::setViewportAndScissor(VkCommandBuffer command)
 {
-  VkFramebufferCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-  ci.renderPass = m_renderPass;
-  ci.width = m_swapchainExtent.width;
-  ci.height = m_swapchainExtent.height;
-  ci.layers = 1;
-  m_framebuffers.clear();
-  for (auto& v : m_swapchainViews)
+  // Y 軸を上向きにするため高さを負にしている.
+  VkViewport viewport;
+  viewport.x = 0.0f;
+  viewport.y = float(m_swapchainExtent.height);
+  viewport.width = float(m_swapchainExtent.width);
+  viewport.height = -1.0f * float(m_swapchainExtent.height);
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor = {
+    { 0, 0 },// offset
+    m_swapchainExtent
+  };
+  vkCmdSetViewport(command, 0, 1, &viewport);
+  vkCmdSetScissor(command, 0, 1, &scissor);
+}
+
+void VulkanAppBase::prepareCommandBuffers()
+{
+  // フレームごとにコマンドプール・コマンドバッファ・フェンスを用意する.
+  // コマンドバッファは毎フレーム記録しなおすので、プールごと vkResetCommandPool でまとめてリセットする.
+  // (RESET_COMMAND_BUFFER_BIT による個別リセットは遅いドライバがある)
+  m_frames.resize(m_framesInFlight);
+  for (auto& frame : m_frames)
   {
-    array<VkImageView, 2> attachments;
-    ci.attachmentCount = uint32_t(attachments.size());
-    ci.pAttachments = attachments.data();
-    attachments[0] = v;
-    attachments[1] = m_depthBufferView;
+    VkCommandPoolCreateInfo poolCI{};
+    poolCI.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolCI.queueFamilyIndex = m_graphicsQueueIndex;
+    poolCI.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    auto result = vkCreateCommandPool(m_device, &poolCI, nullptr, &frame.commandPool);
+    checkResult(result);
 
-    VkFramebuffer framebuffer;
-    auto result = vkCreateFramebuffer(m_device, &ci, nullptr, &framebuffer);
+    VkCommandBufferAllocateInfo ai{};
+    ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    ai.commandPool = frame.commandPool;
+    ai.commandBufferCount = 1;
+    ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    result = vkAllocateCommandBuffers(m_device, &ai, &frame.command);
     checkResult(result);
-    m_framebuffers.push_back(framebuffer);
+
+    // マルチスレッド記録用のプールとセカンダリコマンドバッファ
+    auto workerCount = m_staticCommandMode ? 0 : m_recordingThreads;
+    frame.workerPools.resize(workerCount);
+    frame.workerCommands.resize(workerCount);
+    for (uint32_t i = 0; i < workerCount; ++i)
+    {
+      result = vkCreateCommandPool(m_device, &poolCI, nullptr, &frame.workerPools[i]);
+      checkResult(result);
+      ai.commandPool = frame.workerPools[i];
+      ai.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+      result = vkAllocateCommandBuffers(m_device, &ai, &frame.workerCommands[i]);
+      checkResult(result);
+    }
+
+    frame.timelineValue = 0;
+    frame.inputTime = 0.0;
+    frame.latencyPending = false;
   }
+  m_frameIndex = 0;
 }
-void VulkanAppBase::prepareCommandBuffers()
+
+void VulkanAppBase::prepareSemaphores()
+{
+  VkSemaphoreCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  for (auto& frame : m_frames)
+  {
+    vkCreateSemaphore(m_device, &ci, nullptr, &frame.presentCompletedSem);
+  }
+  m_renderCompletedSems.resize(m_swapchainImages.size());
+  for (auto& v : m_renderCompletedSems)
+  {
+    vkCreateSemaphore(m_device, &ci, nullptr, &v);
+  }
+
+  m_frameTimeline = createTimelineSemaphore(0);
+  m_uploadTimeline = createTimelineSemaphore(0);
+  m_computeTimeline = createTimelineSemaphore(0);
+}
+
+VkSemaphore VulkanAppBase::createTimelineSemaphore(uint64_t initialValue)
+{
+  VkSemaphoreTypeCreateInfo typeCI{};
+  typeCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  typeCI.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  typeCI.initialValue = initialValue;
+
+  VkSemaphoreCreateInfo ci{};
+  ci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  ci.pNext = &typeCI;
+  VkSemaphore semaphore;
+  auto result = vkCreateSemaphore(m_device, &ci, nullptr, &semaphore);
+  checkResult(result);
+  return semaphore;
+}
+
+void VulkanAppBase::waitTimeline(VkSemaphore timeline, uint64_t value)
+{
+  VkSemaphoreWaitInfo wi{};
+  wi.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wi.semaphoreCount = 1;
+  wi.pSemaphores = &timeline;
+  wi.pValues = &value;
+  vkWaitSemaphores(m_device, &wi, UINT64_MAX);
+}
+
+uint64_t VulkanAppBase::getTimelineValue(VkSemaphore timeline) const
+{
+  uint64_t value = 0;
+  vkGetSemaphoreCounterValue(m_device, timeline, &value);
+  return value;
+}
+
+void VulkanAppBase::deferRelease(VkSemaphore timeline, uint64_t value, function<void()> release)
+{
+  m_deferredReleases.push_back({ timeline, value, move(release) });
+}
+
+void VulkanAppBase::processDeferredReleases()
+{
+  // 到達済みのものだけ実行し、残りは次回に回す.
+  vector<DeferredRelease> remains;
+  for (auto& v : m_deferredReleases)
+  {
+    if (getTimelineValue(v.timeline) >= v.value)
+    {
+      v.release();
+    }
+    else
+    {
+      remains.push_back(move(v));
+    }
+  }
+  m_deferredReleases.swap(remains);
+}
+
+VkCommandBuffer VulkanAppBase::beginUploadCommand()
 {
   VkCommandBufferAllocateInfo ai{};
   ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  ai.commandPool = m_commandPool;
-  ai.commandBufferCount = uint32_t(m_swapchainViews.size());
+  ai.commandBufferCount = 1;
+  ai.commandPool = m_transferCommandPool;
   ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  m_commands.resize(ai.commandBufferCount);
-  auto result = vkAllocateCommandBuffers(m_device, &ai, m_commands.data());
+  VkCommandBuffer command;
+  auto result = vkAllocateCommandBuffers(m_device, &ai, &command);
+  checkResult(result);
+
+  VkCommandBufferBeginInfo commandBI{};
+  commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  commandBI.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(command, &commandBI);
+  return command;
+}
+
+uint64_t VulkanAppBase::submitUploadCommand(VkCommandBuffer command)
+{
+  // 解放のバリアはここでまとめて記録する.
+  m_uploadStates.flush(command);
+  vkEndCommandBuffer(command);
+
+  auto value = ++m_uploadTimelineValue;
+  VkTimelineSemaphoreSubmitInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.signalSemaphoreValueCount = 1;
+  timelineInfo.pSignalSemaphoreValues = &value;
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &command;
+  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.pSignalSemaphores = &m_uploadTimeline;
+  auto result = vkQueueSubmit(m_transferQueue, 1, &submitInfo, VK_NULL_HANDLE);
   checkResult(result);
 
-  // コマンドバッファのフェンスも同数用意する.
-  m_fences.resize(ai.commandBufferCount);
-  VkFenceCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  ci.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-  for (auto& v : m_fences)
+  // 転送が終わったらコマンドバッファを解放する.
+  deferRelease(m_uploadTimeline, value, [this, command]() {
+    vkFreeCommandBuffers(m_device, m_transferCommandPool, 1, &command);
+  });
+  return value;
+}
+
+VkCommandBuffer VulkanAppBase::beginComputeCommand()
+{
+  VkCommandBufferAllocateInfo ai{};
+  ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  ai.commandBufferCount = 1;
+  ai.commandPool = m_computeCommandPool;
+  ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  VkCommandBuffer command;
+  auto result = vkAllocateCommandBuffers(m_device, &ai, &command);
+  checkResult(result);
+
+  VkCommandBufferBeginInfo commandBI{};
+  commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  commandBI.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(command, &commandBI);
+  return command;
+}
+
+uint64_t VulkanAppBase::submitComputeCommand(VkCommandBuffer command, uint64_t waitFrameValue)
+{
+  vkEndCommandBuffer(command);
+
+  // 転送済みのデータを使うことがあるため、送信済みの転送の完了も待つ.
+  auto value = ++m_computeTimelineValue;
+  array<VkSemaphore, 2> waitSems = { m_uploadTimeline, m_frameTimeline };
+  array<uint64_t, 2> waitValues = { m_uploadTimelineValue, waitFrameValue };
+  array<VkPipelineStageFlags, 2> waitStageMasks = {
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+  };
+  VkTimelineSemaphoreSubmitInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount = waitFrameValue != 0 ? 2 : 1;
+  timelineInfo.pWaitSemaphoreValues = waitValues.data();
+  timelineInfo.signalSemaphoreValueCount = 1;
+  timelineInfo.pSignalSemaphoreValues = &value;
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &command;
+  submitInfo.waitSemaphoreCount = timelineInfo.waitSemaphoreValueCount;
+  submitInfo.pWaitSemaphores = waitSems.data();
+  submitInfo.pWaitDstStageMask = waitStageMasks.data();
+  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.pSignalSemaphores = &m_computeTimeline;
+  auto result = vkQueueSubmit(m_computeQueue, 1, &submitInfo, VK_NULL_HANDLE);
+  checkResult(result);
+
+  deferRelease(m_computeTimeline, value, [this, command]() {
+    vkFreeCommandBuffers(m_device, m_computeCommandPool, 1, &command);
+  });
+  return value;
+}
+
+void VulkanAppBase::addFrameWait(VkSemaphore timeline, uint64_t value, VkPipelineStageFlags stage)
+{
+  m_frameWaits.push_back({ timeline, value, stage });
+}
+
+void VulkanAppBase::beginImageUpload(VkImage image, const VkImageSubresourceRange& range)
+{
+  m_uploadStates.addImage(image, range, { 0, 0, VK_IMAGE_LAYOUT_UNDEFINED });
+  m_uploadStates.useImage(image,
+    { VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL });
+}
+
+void VulkanAppBase::flushUploadBarriers(VkCommandBuffer command)
+{
+  m_uploadStates.flush(command);
+}
+
+void VulkanAppBase::releaseUploadedImage(VkImage image, VkImageLayout newLayout,
+  VkPipelineStageFlags2KHR dstStage, VkAccessFlags2KHR dstAccess)
+{
+  ResourceStateTracker::State state = { dstStage, dstAccess, newLayout };
+  if (!hasDedicatedTransferQueue())
   {
-    result = vkCreateFence(m_device, &ci, nullptr, &v);
-    checkResult(result);
+    // 同じキューなので通常のレイアウト遷移でよい.
+    m_uploadStates.useImage(image, state);
+    m_uploadStates.removeImage(image);
+    return;
   }
+  m_uploadStates.transferImage(image, m_transferQueueIndex, m_graphicsQueueIndex, state, m_acquireStates);
 }
 
-void VulkanAppBase::prepareSemaphores()
+void VulkanAppBase::releaseUploadedBuffer(VkBuffer buffer, VkPipelineStageFlags2KHR dstStage, VkAccessFlags2KHR dstAccess)
 {
-  VkSemaphoreCreateInfo ci{};
-  ci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  vkCreateSemaphore(m_device, &ci, nullptr, &m_renderCompletedSem);
-  vkCreateSemaphore(m_device, &ci, nullptr, &m_presentCompletedSem);
+  if (!hasDedicatedTransferQueue())
+  {
+    // 同じキューではフレーム側のセマフォ待ちでメモリの可視性が保証されるので何もしない.
+    return;
+  }
+  m_uploadStates.addBuffer(buffer, { VK_PIPELINE_STAGE_2_COPY_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR, VK_IMAGE_LAYOUT_UNDEFINED });
+  m_uploadStates.transferBuffer(buffer, m_transferQueueIndex, m_graphicsQueueIndex,
+    { dstStage, dstAccess, VK_IMAGE_LAYOUT_UNDEFINED }, m_acquireStates);
 }
 
 
@@ -510,9 +1407,20 @@ uint32_t VulkanAppBase::getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropert
   return result;
 }
 
+bool VulkanAppBase::isDescriptorIndexingSupported() const
+{
+  return m_enabledFeatures.features.features.shaderSampledImageArrayDynamicIndexing &&
+    m_enabledFeatures.vulkan12.runtimeDescriptorArray &&
+    m_enabledFeatures.vulkan12.descriptorBindingPartiallyBound &&
+    m_enabledFeatures.vulkan12.descriptorBindingVariableDescriptorCount;
+}
 
 void VulkanAppBase::enableDebugReport()
 {
+  if (!isInstanceExtensionEnabled(VK_EXT_DEBUG_REPORT_EXTENSION_NAME))
+  {
+    return;
+  }
   GetInstanceProcAddr(vkCreateDebugReportCallbackEXT);
   GetInstanceProcAddr(vkDebugReportMessageEXT);
   GetInstanceProcAddr(vkDestroyDebugReportCallbackEXT);
@@ -527,62 +1435,348 @@ void VulkanAppBase::enableDebugReport()
 }
 void VulkanAppBase::disableDebugReport()
 {
-  if (m_vkDestroyDebugReportCallbackEXT)
+  if (isInstanceExtensionEnabled(VK_EXT_DEBUG_REPORT_EXTENSION_NAME) && m_vkDestroyDebugReportCallbackEXT)
   {
     m_vkDestroyDebugReportCallbackEXT(m_instance, m_debugReport, nullptr);
   }
 }
 
-void VulkanAppBase::render()
+void VulkanAppBase::resetFrameCommandPools(FrameContext& frame)
 {
-  uint32_t nextImageIndex = 0;
-  vkAcquireNextImageKHR(m_device, m_swapchain, UINT64_MAX, m_presentCompletedSem, VK_NULL_HANDLE, &nextImageIndex);
-  auto commandFence = m_fences[nextImageIndex];
-  vkWaitForFences(m_device, 1, &commandFence, VK_TRUE, UINT64_MAX);
+  // GPU の完了を待った後なので、このフレームのコマンドバッファはどれも使われていない.
+  vkResetCommandPool(m_device, frame.commandPool, 0);
+  for (auto pool : frame.workerPools)
+  {
+    vkResetCommandPool(m_device, pool, 0);
+  }
+}
 
-  // クリア値
-  array<VkClearValue, 2> clearValue = {
-    { {0.5f, 0.25f, 0.25f, 0.0f}, // for Color
-      {1.0f, 0 } // for Depth
+void VulkanAppBase::collectLatency(double now)
+{
+  // 表示完了を待てない場合は、GPU 処理の完了を確認した時刻で近似する.
+  // 表示キューでの待ちを含まず、確認するまでの最大 1 フレームの誤差もある.
+  for (auto& frame : m_frames)
+  {
+    if (frame.latencyPending && getTimelineValue(m_frameTimeline) >= frame.timelineValue)
+    {
+      lock_guard<mutex> lock(m_presentMutex);
+      addLatencySample(now - frame.inputTime);
+      frame.latencyPending = false;
     }
-  };
+  }
+}
+
+void VulkanAppBase::addLatencySample(double latency)
+{
+  m_latency.latencySum += latency;
+  m_latency.latencyMax = (std::max)(m_latency.latencyMax, latency);
+  m_latency.latencyCount++;
+}
+
+void VulkanAppBase::presentWaitLoop()
+{
+  // 表示されない (最小化中など) 要求で止まらないよう、一定時間で諦めて計測から除く.
+  const uint64_t PresentWaitTimeout = 1000000000ull;  // 1 秒
+  unique_lock<mutex> lock(m_presentMutex);
+  for (;;)
+  {
+    m_presentCond.wait(lock, [this]() { return m_presentWaiterExit || !m_pendingPresents.empty(); });
+    if (m_pendingPresents.empty())
+    {
+      return;
+    }
+    // 待つ間はロックを外し、描画スレッドが次の表示要求を積めるようにする.
+    auto pending = m_pendingPresents.front();
+    lock.unlock();
+    auto result = m_vkWaitForPresentKHR(m_device, pending.swapchain, pending.presentId, PresentWaitTimeout);
+    auto now = glfwGetTime();
+    lock.lock();
+    if (result == VK_SUCCESS)
+    {
+      addLatencySample(now - pending.inputTime);
+    }
+    // 待ち終えてから取り除くので、空になればどのスワップチェインも待っていない.
+    m_pendingPresents.pop_front();
+    m_presentCond.notify_all();
+  }
+}
 
-  VkRenderPassBeginInfo renderPassBI{};
-  renderPassBI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  renderPassBI.renderPass = m_renderPass;
-  renderPassBI.framebuffer = m_framebuffers[nextImageIndex];
-  renderPassBI.renderArea.offset = VkOffset2D{ 0, 0 };
-  renderPassBI.renderArea.extent = m_swapchainExtent;
-  renderPassBI.pClearValues = clearValue.data();
-  renderPassBI.clearValueCount = uint32_t(clearValue.size());
+void VulkanAppBase::waitPresentWaiterIdle()
+{
+  unique_lock<mutex> lock(m_presentMutex);
+  m_presentCond.wait(lock, [this]() { return m_pendingPresents.empty(); });
+}
+
+void VulkanAppBase::reportLatency(double now)
+{
+  lock_guard<mutex> lock(m_presentMutex);
+  if (m_latency.lastFrameTime > 0.0)
+  {
+    m_latency.frameTimeSum += now - m_latency.lastFrameTime;
+    m_latency.frameCount++;
+  }
+  m_latency.lastFrameTime = now;
+
+  const uint32_t ReportInterval = 120;
+  if (m_latency.frameCount < ReportInterval || m_latency.latencyCount == 0)
+  {
+    return;
+  }
+  // latency は表示完了まで. gpu-complete は表示完了を待てない場合の GPU 処理の完了までの近似値.
+  stringstream ss;
+  ss << "device=" << m_physDevProps.deviceName
+    << " present=" << GetPresentModeName(m_presentMode)
+    << " images=" << m_swapchainImages.size()
+    << " frames=" << m_framesInFlight
+    << (m_vkWaitForPresentKHR != nullptr ? " latency" : " gpu-complete")
+    << " avg=" << m_latency.latencySum / m_latency.latencyCount * 1000.0 << "ms"
+    << " max=" << m_latency.latencyMax * 1000.0 << "ms"
+    << " frame=" << m_latency.frameTimeSum / m_latency.frameCount * 1000.0 << "ms"
+    << " record=" << m_latency.recordTimeSum / m_latency.frameCount * 1000.0 << "ms"
+    << " threads=" << (m_staticCommandMode ? 0 : m_recordingThreads) << endl;
+  OutputDebugStringA(ss.str().c_str());
+
+  auto lastFrameTime = m_latency.lastFrameTime;
+  m_latency = LatencyStats();
+  m_latency.lastFrameTime = lastFrameTime;
+}
+
+void VulkanAppBase::recordPendingAcquires(VkCommandBuffer command)
+{
+  // 転送キューで解放されたリソースの所有権を取得する.
+  // このフレームは送信済みの転送の完了を待つため、解放より後に実行される.
+  // 取得後のリソースはアプリケーションが管理するので、追跡はここで終える.
+  m_acquireStates.flush(command);
+  m_acquireStates.clear();
+}
+
+void VulkanAppBase::recordSecondaryCommands(const VkCommandBufferInheritanceInfo& inheritance)
+{
+  // コマンドバッファごとに 1 つのジョブとする. プールはコマンドバッファ単位なので、
+  // どのスレッドで実行されても同じプールが同時に使われることはない.
+  // 実行順はコマンドバッファの番号順なので、分割前の描画順が保たれる.
+  auto& frame = m_frames[m_frameIndex];
+  auto workerCount = uint32_t(frame.workerCommands.size());
+  m_jobSystem.parallelFor(workerCount, 1, [this, &frame, &inheritance, workerCount](uint32_t i, uint32_t) {
+    auto command = frame.workerCommands[i];
+    VkCommandBufferBeginInfo commandBI{};
+    commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBI.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    commandBI.pInheritanceInfo = &inheritance;
+    vkBeginCommandBuffer(command, &commandBI);
+    // 動的ステートはプライマリから継承されないので、それぞれで設定する.
+    setViewportAndScissor(command);
+    makeCommandSecondary(command, i, workerCount);
+    vkEndCommandBuffer(command);
+  });
+}
 
-  // コマンドバッファ・レンダーパス開始
+void VulkanAppBase::recordCommand(VkCommandBuffer command, uint32_t imageIndex, bool oneTime)
+{
   VkCommandBufferBeginInfo commandBI{};
   commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  auto& command = m_commands[nextImageIndex];
+  commandBI.flags = oneTime ? VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0;
   vkBeginCommandBuffer(command, &commandBI);
-  vkCmdBeginRenderPass(command, &renderPassBI, VK_SUBPASS_CONTENTS_INLINE);
-
-  m_imageIndex = nextImageIndex;
-  makeCommand(command);
+  if (oneTime)
+  {
+    recordPendingAcquires(command);
+  }
+  m_recordSecondary = oneTime && !m_frames[m_frameIndex].workerCommands.empty();
+
+  // フレームのグラフを組み立てて実行する.
+  // スワップチェインのイメージは前の内容を使わないので UNDEFINED から始める.
+  // イメージ取得のセマフォはカラー出力のステージで待つので、最初のバリアもそこから始める.
+  m_renderGraph.reset();
+  RenderGraph::ImageDesc colorDesc{ m_surfaceFormat.format, m_swapchainExtent, VK_IMAGE_ASPECT_COLOR_BIT, 0 };
+  auto backBuffer = m_renderGraph.importImage("backbuffer",
+    m_swapchainImages[imageIndex], m_swapchainViews[imageIndex], colorDesc,
+    { VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0 });
+  RenderGraph::ImageDesc depthDesc{ m_depthFormat, m_swapchainExtent, VK_IMAGE_ASPECT_DEPTH_BIT, 0 };
+  auto depthBuffer = m_renderGraph.createImage("depth", depthDesc);
+  buildRenderGraph(m_renderGraph, backBuffer, depthBuffer);
+  m_renderGraph.present(backBuffer);
+  m_renderGraph.compile();
+  m_renderGraph.execute(command);
 
-  // コマンド・レンダーパス終了
-  vkCmdEndRenderPass(command);
   vkEndCommandBuffer(command);
+}
+
+void VulkanAppBase::buildRenderGraph(RenderGraph& graph, RenderGraph::Handle backBuffer, RenderGraph::Handle depthBuffer)
+{
+  addMainPass(graph, backBuffer, depthBuffer);
+}
+
+void VulkanAppBase::addMainPass(RenderGraph& graph, RenderGraph::Handle backBuffer, RenderGraph::Handle depthBuffer, bool depthPrepared)
+{
+  auto secondary = m_recordSecondary;
+  graph.addPass("main", [&](RenderGraph::PassBuilder& builder) {
+    builder.colorAttachment(backBuffer, VK_ATTACHMENT_LOAD_OP_CLEAR, VkClearColorValue{ { 0.5f, 0.25f, 0.25f, 0.0f } });
+    if (depthPrepared)
+    {
+      builder.depthReadOnly(depthBuffer);
+    }
+    else
+    {
+      builder.depthAttachment(depthBuffer, VK_ATTACHMENT_LOAD_OP_CLEAR);
+    }
+    builder.useSecondaryCommandBuffers(secondary);
+  }, [this, secondary](VkCommandBuffer command, const RenderGraph::PassContext& context) {
+    if (secondary)
+    {
+      // 描画はワーカースレッドがセカンダリコマンドバッファに記録する.
+      auto& frame = m_frames[m_frameIndex];
+      VkCommandBufferInheritanceInfo inheritance{};
+      inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+      inheritance.renderPass = context.renderPass;
+      inheritance.subpass = 0;
+      inheritance.framebuffer = context.framebuffer;
+      recordSecondaryCommands(inheritance);
+      vkCmdExecuteCommands(command, uint32_t(frame.workerCommands.size()), frame.workerCommands.data());
+    }
+    else
+    {
+      setViewportAndScissor(command);
+      makeCommand(command);
+    }
+  });
+}
+
+void VulkanAppBase::render()
+{
+  // 直前の glfwPollEvents で入力を取得したので、この時刻を入力時刻とする.
+  auto inputTime = glfwGetTime();
+  if (m_measureLatency)
+  {
+    collectLatency(inputTime);
+    reportLatency(inputTime);
+  }
+
+  // このフレームのリソースを前回使用した GPU 処理の完了を待つ.
+  // 待つのは m_framesInFlight 前のフレームなので、それ以降のフレームとは CPU/GPU が並行して動ける.
+  auto& frame = m_frames[m_frameIndex];
+  waitTimeline(m_frameTimeline, frame.timelineValue);
+  processDeferredReleases();
+  resetFrameCommandPools(frame);
+  if (m_measureLatency)
+  {
+    collectLatency(glfwGetTime());
+  }
+
+  if (m_swapchainOutOfDate && !recreateSwapchain())
+  {
+    // 最小化中は描画せず、ウィンドウが戻るのを待つ.
+    glfwWaitEvents();
+    return;
+  }
+
+  uint32_t nextImageIndex = 0;
+  auto result = vkAcquireNextImageKHR(m_device, m_swapchain, UINT64_MAX, frame.presentCompletedSem, VK_NULL_HANDLE, &nextImageIndex);
+  if (result == VK_ERROR_OUT_OF_DATE_KHR)
+  {
+    // セマフォはシグナルされないので、このフレームは描画せずに作り直す.
+    m_swapchainOutOfDate = true;
+    return;
+  }
+  if (result == VK_SUBOPTIMAL_KHR)
+  {
+    // イメージは取得できているので、このフレームは描画してから作り直す.
+    m_swapchainOutOfDate = true;
+  }
+  if (m_measureLatency)
+  {
+    frame.inputTime = inputTime;
+    frame.latencyPending = (m_vkWaitForPresentKHR == nullptr);
+  }
+
+  m_imageIndex = nextImageIndex;
+  auto recordStart = glfwGetTime();
+  onBeginFrame();
+  vector<VkCommandBuffer> submitCommands;
+  if (m_staticCommandMode)
+  {
+    // 記録済みのコマンドを再利用する. 変更があった場合だけ記録しなおす.
+    if (m_staticCommandDirty[nextImageIndex])
+    {
+      // 以前の送信がまだ実行中の可能性があるので、その完了を待ってから記録する.
+      // プールに個別リセットの指定がないので、解放して確保しなおす.
+      waitTimeline(m_frameTimeline, m_staticCommandUse[nextImageIndex]);
+      auto& command = m_staticCommands[nextImageIndex];
+      vkFreeCommandBuffers(m_device, m_commandPool, 1, &command);
+      VkCommandBufferAllocateInfo ai{};
+      ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      ai.commandPool = m_commandPool;
+      ai.commandBufferCount = 1;
+      ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      result = vkAllocateCommandBuffers(m_device, &ai, &command);
+      checkResult(result);
+      recordCommand(command, nextImageIndex, false);
+      m_staticCommandDirty[nextImageIndex] = false;
+    }
+    // 所有権の取得が必要なときだけフレーム用のコマンドバッファにバリアを記録して先に実行する.
+    if (m_acquireStates.hasPendingBarriers())
+    {
+      VkCommandBufferBeginInfo commandBI{};
+      commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      commandBI.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      vkBeginCommandBuffer(frame.command, &commandBI);
+      recordPendingAcquires(frame.command);
+      vkEndCommandBuffer(frame.command);
+      submitCommands.push_back(frame.command);
+    }
+    submitCommands.push_back(m_staticCommands[nextImageIndex]);
+  }
+  else
+  {
+    recordCommand(frame.command, nextImageIndex, true);
+    submitCommands.push_back(frame.command);
+  }
+  if (m_measureLatency)
+  {
+    m_latency.recordTimeSum += glfwGetTime() - recordStart;
+  }
 
   // コマンドを実行（送信)
+  // イメージの取得と送信済みの転送処理 (と addFrameWait で追加された待ち) を待ち、
+  // 完了したら m_frameTimeline を進める.
+  // Present はタイムラインセマフォを待てないので、描画完了はバイナリセマフォでも通知する.
+  frame.timelineValue = ++m_frameTimelineValue;
+  vector<VkSemaphore> waitSems = { frame.presentCompletedSem, m_uploadTimeline };
+  vector<uint64_t> waitValues = { 0, m_uploadTimelineValue };
+  vector<VkPipelineStageFlags> waitStageMasks = {
+    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT
+  };
+  for (const auto& v : m_frameWaits)
+  {
+    waitSems.push_back(v.timeline);
+    waitValues.push_back(v.value);
+    waitStageMasks.push_back(v.stage);
+  }
+  m_frameWaits.clear();
+  array<VkSemaphore, 2> signalSems = { m_frameTimeline, m_renderCompletedSems[nextImageIndex] };
+  array<uint64_t, 2> signalValues = { frame.timelineValue, 0 };
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount = uint32_t(waitValues.size());
+  timelineInfo.pWaitSemaphoreValues = waitValues.data();
+  timelineInfo.signalSemaphoreValueCount = uint32_t(signalValues.size());
+  timelineInfo.pSignalSemaphoreValues = signalValues.data();
+
   VkSubmitInfo submitInfo{};
-  VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &command;
-  submitInfo.pWaitDstStageMask = &waitStageMask;
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = &m_presentCompletedSem;
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = &m_renderCompletedSem;
-  vkResetFences(m_device, 1, &commandFence);
-  vkQueueSubmit(m_deviceQueue, 1, &submitInfo, commandFence);
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.commandBufferCount = uint32_t(submitCommands.size());
+  submitInfo.pCommandBuffers = submitCommands.data();
+  submitInfo.pWaitDstStageMask = waitStageMasks.data();
+  submitInfo.waitSemaphoreCount = uint32_t(waitSems.size());
+  submitInfo.pWaitSemaphores = waitSems.data();
+  submitInfo.signalSemaphoreCount = uint32_t(signalSems.size());
+  submitInfo.pSignalSemaphores = signalSems.data();
+  vkQueueSubmit(m_deviceQueue, 1, &submitInfo, VK_NULL_HANDLE);
+  if (m_staticCommandMode)
+  {
+    m_staticCommandUse[nextImageIndex] = frame.timelineValue;
+  }
 
   // Present 処理
   VkPresentInfoKHR presentInfo{};
@@ -591,6 +1785,30 @@ void VulkanAppBase::render()
   presentInfo.pSwapchains = &m_swapchain;
   presentInfo.pImageIndices = &nextImageIndex;
   presentInfo.waitSemaphoreCount = 1;
-  presentInfo.pWaitSemaphores = &m_renderCompletedSem;
-  vkQueuePresentKHR(m_deviceQueue, &presentInfo);
+  presentInfo.pWaitSemaphores = &m_renderCompletedSems[nextImageIndex];
+  // 遅延計測では表示要求に ID を付け、表示完了を待ちのスレッドで待つ.
+  VkPresentIdKHR presentIdInfo{};
+  auto presentId = ++m_presentId;
+  if (m_vkWaitForPresentKHR != nullptr)
+  {
+    presentIdInfo.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    presentIdInfo.swapchainCount = 1;
+    presentIdInfo.pPresentIds = &presentId;
+    presentInfo.pNext = &presentIdInfo;
+  }
+  result = vkQueuePresentKHR(m_deviceQueue, &presentInfo);
+  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+  {
+    m_swapchainOutOfDate = true;
+  }
+  if (m_presentWaiter.joinable() && (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR))
+  {
+    {
+      lock_guard<mutex> lock(m_presentMutex);
+      m_pendingPresents.push_back({ m_swapchain, presentId, frame.inputTime });
+    }
+    m_presentCond.notify_all();
+  }
+
+  m_frameIndex = (m_frameIndex + 1) % m_framesInFlight;
 }
\ No newline at end of file
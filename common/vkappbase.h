@@ -11,74 +11,318 @@
 #include <vulkan/vulkan_win32.h>
 
 #include <vector>
+#include <string>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "jobsystem.h"
+#include "rendergraph.h"
+#include "resourcestate.h"
+#include "pipelinecache.h"
 
 class VulkanAppBase
 {
 public:
+  // 機能の集合. VkPhysicalDeviceFeatures2 に Vulkan 1.2 の機能と拡張の機能を連結したもの.
+  struct FeatureSet
+  {
+    VkPhysicalDeviceFeatures2 features;
+    VkPhysicalDeviceVulkan12Features vulkan12;
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2;
+    VkPhysicalDevicePresentIdFeaturesKHR presentId;
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWait;
+
+    FeatureSet();
+    FeatureSet(const FeatureSet& rhs);
+    FeatureSet& operator=(const FeatureSet& rhs);
+
+    // pNext を連結しなおす. 拡張の構造体は hasExtension がその拡張名に true を返すものだけを連結する.
+    void link(const std::function<bool(const char*)>& hasExtension);
+
+    // 全機能の VkBool32 メンバへのポインタ
+    std::vector<VkBool32*> bits();
+    // other で有効な機能がすべて有効か
+    bool contains(const FeatureSet& other) const;
+    // 有効な機能の数
+    uint32_t count() const;
+  };
+
+  // アプリケーションが要求する拡張と機能.
+  // 必須のものが使えないデバイスは選択されず、任意のものは対応している場合のみ有効化される.
+  struct Requirements
+  {
+    std::vector<std::string> instanceExtensions;
+    std::vector<std::string> optionalInstanceExtensions;
+    std::vector<std::string> deviceExtensions;
+    std::vector<std::string> optionalDeviceExtensions;
+    FeatureSet features;
+    FeatureSet optionalFeatures;
+  };
+
   VulkanAppBase();
   virtual ~VulkanAppBase() { }
   void initialize(GLFWwindow* window, const char* appName);
   void terminate();
 
+  // 同時に処理するフレーム数 (initialize 前に設定する)
+  void setFramesInFlight(uint32_t count);
+  // 表示モードとスワップチェインのイメージ数 (initialize 前に設定する).
+  // サーフェースが対応していない場合は FIFO / 対応範囲内の値に置き換えられる.
+  void setPresentMode(VkPresentModeKHR mode);
+  void setSwapchainImageCount(uint32_t count); // 0 なら自動
+  // 静的コマンドモード (initialize 前に設定する).
+  // スワップチェインのイメージごとにコマンドを 1 度だけ記録し、以降は送信のみ行う.
+  // makeCommand の内容を変えるときは markCommandsDirty を呼ぶ. 毎フレーム変わるデータは
+  // コマンドに埋め込まず、ユニフォームバッファなどの永続的なバッファ経由で渡すこと.
+  void setStaticCommandMode(bool enable) { m_staticCommandMode = enable; }
+  void markCommandsDirty();
+  // マルチスレッド記録 (initialize 前に設定する. 静的コマンドモードとは併用しない).
+  // 1 以上を指定すると makeCommand の代わりに makeCommandSecondary を指定数のスレッドで並列に呼び、
+  // 記録されたセカンダリコマンドバッファをプライマリから vkCmdExecuteCommands で実行する.
+  void setRecordingThreads(uint32_t count) { m_recordingThreads = count; }
+  // ジョブシステムのワーカースレッド数 (initialize 前に設定する. 0 ならコア数 - 1).
+  void setJobThreads(uint32_t count) { m_jobThreads = count; }
+
+  // 入力から表示までの遅延の計測 (initialize 前に設定する). 一定フレームごとにデバッグ出力へ表示する.
+  // VK_KHR_present_wait が使えれば表示完了までを計測し、使えなければ GPU の完了までで近似する.
+  void setLatencyMeasurement(bool enable) { m_measureLatency = enable; }
+  // 使用する物理デバイスの指定 (名前の一部・列挙順の番号・UUID). 空か、一致するものがなければ自動で選択する.
+  void setPhysicalDeviceOverride(const std::string& device) { m_deviceOverride = device; }
+
+  // コマンドライン引数 (--key=value 形式) で上記の設定を行う.
+  //   --present=fifo|fifo_relaxed|mailbox|immediate
+  //   --images=N  --frames=N  --threads=N  --jobs=N  --measure-latency  --device=名前|番号|UUID
+  void applyCommandLine(const wchar_t* cmdLine);
+
   virtual void render();
 
   virtual void prepare() { }
   virtual void cleanup() { }
   virtual void makeCommand(VkCommandBuffer command) { }
+  // workerCount 個に分割した描画のうち workerIndex 番目を記録する. 複数のスレッドから同時に呼ばれる.
+  // command はレンダーパスを継承したセカンダリコマンドバッファで、ビューポートとシザーは設定済み.
+  virtual void makeCommandSecondary(VkCommandBuffer command, uint32_t workerIndex, uint32_t workerCount) { }
+  // コマンドの記録前に毎フレームメインスレッドで呼ばれる. (ユニフォームバッファの更新など)
+  virtual void onBeginFrame() { }
 protected:
   static void checkResult(VkResult);
 
+  // 派生クラス独自のコマンドラインオプション. 処理した場合は true を返す.
+  virtual bool parseOption(const std::wstring& key, const std::wstring& value) { return false; }
+  // 派生クラスが必要とする拡張と機能を req に追加する. (インスタンス生成前に呼ばれる)
+  virtual void declareRequirements(Requirements& req) { }
+  // スワップチェインを作り直した後に呼ばれる. (GPU はこのスワップチェインの処理を終えている)
+  virtual void onSwapchainRecreated() { }
+  // 1 フレーム分の描画パスを graph に追加する. backBuffer は表示するイメージ、depthBuffer は一時イメージ.
+  // 既定ではメインパス (addMainPass) だけを追加する.
+  virtual void buildRenderGraph(RenderGraph& graph, RenderGraph::Handle backBuffer, RenderGraph::Handle depthBuffer);
+  // makeCommand (またはマルチスレッド記録) で描画するパス. m_renderPass と互換のレンダーパスで実行される.
+  // depthPrepared なら深度は前のパスで書き込み済みとして、クリアせず読み取り専用で使う.
+  void addMainPass(RenderGraph& graph, RenderGraph::Handle backBuffer, RenderGraph::Handle depthBuffer, bool depthPrepared = false);
+
+  bool isInstanceExtensionEnabled(const char* name) const;
+  bool isDeviceExtensionEnabled(const char* name) const;
+  FeatureSet queryFeatures(VkPhysicalDevice physDev) const;
+  void reportEnabledExtensionsAndFeatures() const;
+
   void initializeInstance(const char* appName);
   void selectPhysicalDevice();
-  uint32_t searchGraphicsQueueIndex();
+  int64_t scorePhysicalDevice(VkPhysicalDevice physDev) const;
+  bool matchPhysicalDevice(VkPhysicalDevice physDev, uint32_t index, const std::string& key) const;
+  uint32_t searchGraphicsQueueIndex(VkPhysicalDevice physDev) const;
+  uint32_t searchTransferQueueIndex();
+  uint32_t searchComputeQueueIndex();
   void createDevice();
   void prepareCommandPool();
   void selectSurfaceFormat(VkFormat format);
   void createSwapchain(GLFWwindow* window);
-  void createDepthBuffer();
   void createViews();
 
   void createRenderPass();
-  void createFramebuffer();
+
+  // ウィンドウサイズの変更などでスワップチェインが使えなくなったときに作り直す.
+  // パイプラインはそのまま使えるよう、ビューポートとシザーは動的ステートで設定する.
+  bool recreateSwapchain();
+  void destroySwapchainResources();
+  void setViewportAndScissor(VkCommandBuffer command);
 
   void prepareCommandBuffers();
   void prepareSemaphores();
+  void prepareStaticCommands();
+
+  // 1 フレーム分のコマンド (レンダーグラフの各パス) を記録する.
+  void recordCommand(VkCommandBuffer command, uint32_t imageIndex, bool oneTime);
+  void recordPendingAcquires(VkCommandBuffer command);
+  void recordSecondaryCommands(const VkCommandBufferInheritanceInfo& inheritance);
+
+  void collectLatency(double now);
+  void reportLatency(double now);
+  void addLatencySample(double latency);
+  // 表示要求の ID を順に vkWaitForPresentKHR で待ち、表示完了の時刻で遅延を記録するスレッド.
+  void presentWaitLoop();
+  // 待ち中の表示要求がなくなるまで待つ. (スワップチェインの破棄前に呼ぶ)
+  void waitPresentWaiterIdle();
 
   uint32_t getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropertyFlags requestProps)const;
+
+  // bindless テクスチャ (ディスクリプタインデックス) の機能が有効か
+  bool isDescriptorIndexingSupported() const;
+
+  // タイムラインセマフォ. 処理の完了をフレーム番号などの単調増加する値で待てる.
+  VkSemaphore createTimelineSemaphore(uint64_t initialValue);
+  void waitTimeline(VkSemaphore timeline, uint64_t value);
+  uint64_t getTimelineValue(VkSemaphore timeline) const;
+
+  // timeline が value に達した (GPU が使い終わった) 後に release を実行する.
+  void deferRelease(VkSemaphore timeline, uint64_t value, std::function<void()> release);
+  void processDeferredReleases();
+
+  // 転送用のコマンドバッファ. submitUploadCommand は完了時の m_uploadTimeline の値を返す.
+  // 送信した転送処理は次に送信するフレームの描画より前に完了する.
+  // 転送専用キューがあればそちらで実行されるため、グラフィックス用のステージは使えない.
+  VkCommandBuffer beginUploadCommand();
+  uint64_t submitUploadCommand(VkCommandBuffer command);
+
+  // 転送先のイメージを登録し、転送先レイアウトへの遷移を積む. 積んだバリアは flushUploadBarriers で
+  // まとめて記録するので、複数のイメージを登録してから 1 回呼ぶとよい. (コピーより前に呼ぶこと)
+  void beginImageUpload(VkImage image, const VkImageSubresourceRange& range);
+  void flushUploadBarriers(VkCommandBuffer command);
+  // 転送を終えたリソースをグラフィックスキューで使える状態にする. バリアは submitUploadCommand でまとめて記録する.
+  // 転送専用キューの場合はキューファミリーの所有権を解放し、取得側のバリアは次のフレームの先頭で記録する.
+  void releaseUploadedImage(VkImage image, VkImageLayout newLayout,
+    VkPipelineStageFlags2KHR dstStage, VkAccessFlags2KHR dstAccess);
+  void releaseUploadedBuffer(VkBuffer buffer, VkPipelineStageFlags2KHR dstStage, VkAccessFlags2KHR dstAccess);
+  bool hasDedicatedTransferQueue() const { return m_transferQueueIndex != m_graphicsQueueIndex; }
+
+  // 非同期コンピュート. 専用のキューがなければグラフィックスキューで実行される.
+  // submitComputeCommand は完了時の m_computeTimeline の値を返す.
+  // waitFrameValue が 0 以外なら、m_frameTimeline がその値に達してから実行する.
+  // キュー間で共有するリソースは VK_SHARING_MODE_CONCURRENT で
+  // m_graphicsQueueIndex と m_computeQueueIndex を指定して作成すること.
+  VkCommandBuffer beginComputeCommand();
+  uint64_t submitComputeCommand(VkCommandBuffer command, uint64_t waitFrameValue = 0);
+  bool hasAsyncComputeQueue() const { return m_computeQueueIndex != m_graphicsQueueIndex; }
+
+  // 次に送信するフレームの描画に、タイムラインセマフォの待ちを追加する.
+  void addFrameWait(VkSemaphore timeline, uint64_t value, VkPipelineStageFlags stage);
   
   void enableDebugReport();
   void disableDebugReport();
 
 
+  GLFWwindow* m_window;
   VkInstance  m_instance;
   VkDevice    m_device;
   VkPhysicalDevice  m_physDev;
 
+  std::string   m_deviceOverride;
+
   VkSurfaceKHR        m_surface;
   VkSurfaceFormatKHR  m_surfaceFormat;
   VkSurfaceCapabilitiesKHR  m_surfaceCaps;
 
   VkPhysicalDeviceMemoryProperties m_physMemProps;
+  VkPhysicalDeviceProperties  m_physDevProps;
+
+  // 拡張と機能のネゴシエーション結果
+  Requirements  m_requirements;
+  std::vector<std::string> m_enabledInstanceExtensions;
+  std::vector<std::string> m_enabledDeviceExtensions;
+  FeatureSet    m_supportedFeatures;  // 選択したデバイスが対応している機能
+  FeatureSet    m_enabledFeatures;    // 実際に有効化した機能
 
   uint32_t m_graphicsQueueIndex;
   VkQueue m_deviceQueue;
+  // 転送用キュー (転送専用のファミリーがなければグラフィックス用と同じもの)
+  uint32_t m_transferQueueIndex;
+  VkQueue m_transferQueue;
+  VkCommandPool m_transferCommandPool;
+  // コンピュート用キュー (コンピュート専用のファミリーがなければグラフィックス用と同じもの)
+  uint32_t m_computeQueueIndex;
+  VkQueue m_computeQueue;
+  VkCommandPool m_computeCommandPool;
+
+  // 転送コマンド内のリソースの状態と、転送キューから所有権を取得するためのバリア (次のフレームの先頭で記録する)
+  ResourceStateTracker  m_uploadStates;
+  ResourceStateTracker  m_acquireStates;
 
   VkCommandPool m_commandPool;
   VkPresentModeKHR m_presentMode;
+  uint32_t  m_swapchainImageCount;  // 要求するイメージ数 (0 なら自動)
   VkSwapchainKHR  m_swapchain;
+  bool          m_swapchainOutOfDate;  // 次の描画前に作り直しが必要
   VkExtent2D    m_swapchainExtent;
   std::vector<VkImage> m_swapchainImages;
   std::vector<VkImageView> m_swapchainViews;
 
-  VkImage         m_depthBuffer;
-  VkDeviceMemory  m_depthBufferMemory;
-  VkImageView     m_depthBufferView;
+  VkFormat        m_depthFormat;
 
+  // フレームのパスとバリア、デプスバッファなどの一時イメージはレンダーグラフが管理する.
+  // m_renderPass はメインパスと互換のレンダーパスで、パイプラインの作成に使う. (グラフが所有する)
+  RenderGraph       m_renderGraph;
   VkRenderPass      m_renderPass;
-  std::vector<VkFramebuffer>    m_framebuffers;
+  // パイプラインは記述 (PipelineDesc) から引く. 同じ記述のパイプラインは共有され、キャッシュが所有する.
+  PipelineCache     m_pipelineCache;
+  bool              m_recordSecondary;  // 記録中のフレームでセカンダリコマンドバッファを使う
+
+  // フレーム単位のリソース.
+  // スワップチェインのイメージ数とは独立に、m_framesInFlight 個を巡回して使う.
+  struct FrameContext
+  {
+    VkCommandPool   commandPool;
+    VkCommandBuffer command;
+    uint64_t        timelineValue;        // このフレームの完了時の m_frameTimeline の値
+    VkSemaphore     presentCompletedSem;  // イメージ取得 (表示完了) の通知用
 
-  std::vector<VkFence>          m_fences;
-  VkSemaphore   m_renderCompletedSem, m_presentCompletedSem;
+    // マルチスレッド記録用. プールはスレッド間で共有できないのでスレッドごとに持つ.
+    std::vector<VkCommandPool>    workerPools;
+    std::vector<VkCommandBuffer>  workerCommands;
+
+    double  inputTime;        // 遅延計測用: このフレームの入力を取得した時刻
+    bool    latencyPending;   // 遅延計測用: GPU 完了をまだ確認していない (表示完了を待てない場合のみ)
+  };
+  uint32_t  m_framesInFlight;
+  std::vector<FrameContext>  m_frames;
+  void resetFrameCommandPools(FrameContext& frame);
+  // 静的コマンドモード用. スワップチェインのイメージ単位で持つ.
+  bool  m_staticCommandMode;
+  uint32_t  m_recordingThreads;
+
+  // 読み込みや記録の並列化に使うジョブシステム. prepare より前に初期化される.
+  JobSystem m_jobSystem;
+  uint32_t  m_jobThreads;
+  std::vector<VkCommandBuffer> m_staticCommands;
+  std::vector<bool>     m_staticCommandDirty;
+  std::vector<uint64_t> m_staticCommandUse;   // 最後に送信したフレームの m_frameTimeline の値
+
+  // 描画完了の通知は Present が待つため、スワップチェインのイメージ単位で持つ.
+  std::vector<VkSemaphore>  m_renderCompletedSems;
+
+  // フレームの完了 / 転送の完了を通知するタイムラインセマフォと、最後に送信した処理の値
+  VkSemaphore m_frameTimeline;
+  uint64_t    m_frameTimelineValue;
+  VkSemaphore m_uploadTimeline;
+  uint64_t    m_uploadTimelineValue;
+  VkSemaphore m_computeTimeline;
+  uint64_t    m_computeTimelineValue;
+
+  struct FrameWait
+  {
+    VkSemaphore timeline;
+    uint64_t    value;
+    VkPipelineStageFlags stage;
+  };
+  std::vector<FrameWait> m_frameWaits;
+
+  struct DeferredRelease
+  {
+    VkSemaphore timeline;
+    uint64_t    value;
+    std::function<void()> release;
+  };
+  std::vector<DeferredRelease> m_deferredReleases;
 
   // デバッグレポート関連
   PFN_vkCreateDebugReportCallbackEXT	m_vkCreateDebugReportCallbackEXT;
@@ -86,7 +330,35 @@ protected:
   PFN_vkDestroyDebugReportCallbackEXT m_vkDestroyDebugReportCallbackEXT;
   VkDebugReportCallbackEXT  m_debugReport;
 
-  std::vector<VkCommandBuffer> m_commands;
+  // 遅延計測
+  struct LatencyStats
+  {
+    double  latencySum, latencyMax;
+    uint32_t  latencyCount;
+    double  frameTimeSum;
+    double  recordTimeSum;  // コマンドの記録にかかった CPU 時間
+    uint32_t  frameCount;
+    double  lastFrameTime;
+  };
+  bool  m_measureLatency;
+  LatencyStats  m_latency;
+
+  // 表示完了の待ち (VK_KHR_present_id / present_wait). 使えない場合 m_vkWaitForPresentKHR は nullptr.
+  // m_latency は待ちのスレッドからも更新するので、m_presentMutex で保護する.
+  struct PendingPresent
+  {
+    VkSwapchainKHR swapchain;
+    uint64_t  presentId;
+    double    inputTime;
+  };
+  PFN_vkWaitForPresentKHR m_vkWaitForPresentKHR;
+  uint64_t  m_presentId;  // 最後に表示を要求したときの ID
+  std::thread m_presentWaiter;
+  std::mutex  m_presentMutex;
+  std::condition_variable m_presentCond;
+  std::deque<PendingPresent> m_pendingPresents;
+  bool  m_presentWaiterExit;
 
-  uint32_t  m_imageIndex;
+  uint32_t  m_imageIndex;  // 描画先のスワップチェインイメージ番号
+  uint32_t  m_frameIndex;  // 現在のフレーム番号 (0 ～ m_framesInFlight-1)
 };